@@ -0,0 +1,165 @@
+/*
+ * bloom.c
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE
+
+#include "bloom.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOOM_MAGIC   "DRBF"
+#define BLOOM_VERSION 1
+#define BLOOM_MINBITS 6
+
+#define HASH1 0x9E3779B97F4A7C15ULL
+#define HASH2 0xC2B2AE3D27D4EB4FULL
+
+/* The bits of the filter follow the header, in byte order. */
+struct bloom_header {
+    char     magic[4];
+    uint8_t  version;
+    uint8_t  log2bits;
+    uint8_t  reserved[2];
+};
+
+struct bloom {
+    struct bloom_header header;
+    uint8_t             bits[];
+};
+
+
+static inline uint8_t
+fold (uint8_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+
+static inline uint32_t
+hash (uint32_t trigram, uint64_t mult, unsigned log2bits)
+{
+    return (uint32_t) ((trigram * mult) >> (64 - log2bits));
+}
+
+
+void
+trigrams_add (struct trigrams *set, const void *data, size_t size, uint32_t *state)
+{
+    const uint8_t *p = data;
+    uint32_t window = *state & 0xFFFFFF;
+    unsigned fill = *state >> 24;
+
+    for (size_t i = 0; i < size; i++) {
+        window = ((window << 8) | fold (p[i])) & 0xFFFFFF;
+        if (fill < 3 && ++fill < 3)
+            continue;
+
+        uint64_t *word = &set->bits[window / 64];
+        const uint64_t bit = 1ULL << (window % 64);
+        if (!(*word & bit)) {
+            *word |= bit;
+            set->count++;
+        }
+    }
+    *state = window | (fill << 24);
+}
+
+
+bool
+trigrams_save (struct trigrams *set, int fd)
+{
+    unsigned log2bits = BLOOM_MINBITS;
+    while ((1ULL << log2bits) < set->count * BLOOM_BITS)
+        log2bits++;
+
+    const size_t size = (1ULL << log2bits) / 8;
+    struct bloom *bloom = calloc (1, sizeof (struct bloom) + size);
+    if (!bloom)
+        return false;
+
+    memcpy (bloom->header.magic, BLOOM_MAGIC, sizeof (bloom->header.magic));
+    bloom->header.version = BLOOM_VERSION;
+    bloom->header.log2bits = log2bits;
+
+    for (size_t i = 0; set->count && i < sizeof (set->bits) / sizeof (set->bits[0]); i++) {
+        for (uint64_t word = set->bits[i]; word; word &= word - 1) {
+            const uint32_t trigram = i * 64 + __builtin_ctzll (word);
+            const uint32_t h1 = hash (trigram, HASH1, log2bits);
+            const uint32_t h2 = hash (trigram, HASH2, log2bits);
+            bloom->bits[h1 / 8] |= 1 << (h1 % 8);
+            bloom->bits[h2 / 8] |= 1 << (h2 % 8);
+            set->count--;
+        }
+        set->bits[i] = 0;
+    }
+
+    struct iovec iov = iov_from_data (bloom, sizeof (struct bloom) + size);
+    const bool ok = writev_all(fd, &iov, 1) >= 0;
+    free (bloom);
+    return ok;
+}
+
+
+struct bloom*
+bloom_load (int fd)
+{
+    struct stat st;
+    if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (struct bloom_header))
+        return NULL;
+
+    struct bloom *bloom = malloc (st.st_size);
+    if (!bloom)
+        return NULL;
+
+    size_t n = 0;
+    ssize_t r;
+    while (n < (size_t) st.st_size &&
+           (r = safe_read (fd, (uint8_t*) bloom + n, st.st_size - n)) > 0)
+        n += r;
+
+    if (n != (size_t) st.st_size ||
+        memcmp (bloom->header.magic, BLOOM_MAGIC, sizeof (bloom->header.magic)) ||
+        bloom->header.version != BLOOM_VERSION ||
+        bloom->header.log2bits < BLOOM_MINBITS || bloom->header.log2bits > 32 ||
+        n != sizeof (struct bloom) + (1ULL << bloom->header.log2bits) / 8) {
+        free (bloom);
+        return NULL;
+    }
+    return bloom;
+}
+
+
+void
+bloom_free (struct bloom *bloom)
+{
+    free (bloom);
+}
+
+
+bool
+bloom_check (const struct bloom *bloom, const void *text, size_t size)
+{
+    const unsigned log2bits = bloom->header.log2bits;
+    const uint8_t *p = text;
+    uint32_t window = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        window = ((window << 8) | fold (p[i])) & 0xFFFFFF;
+        if (i < 2)
+            continue;
+
+        const uint32_t h1 = hash (window, HASH1, log2bits);
+        const uint32_t h2 = hash (window, HASH2, log2bits);
+        if (!(bloom->bits[h1 / 8] & (1 << (h1 % 8))) ||
+            !(bloom->bits[h2 / 8] & (1 << (h2 % 8))))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,53 @@
+/*
+ * bloom.h
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef __bloom_h__
+#define __bloom_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef BLOOM_SUFFIX
+#define BLOOM_SUFFIX ".bloom"
+#endif /* !BLOOM_SUFFIX */
+
+/*
+ * Filters of the trigrams (sequences of three bytes, with ASCII letters
+ * folded to lowercase) in a log file, which allow telling that some text
+ * does not appear in it without reading the file: if any trigram of the
+ * text is not in the filter, the text is not in the file either.
+ *
+ * While a file is written, the trigrams in it are kept in a set with one
+ * bit for each of the 2^24 possible ones; once the file is complete, the
+ * set is turned into a Bloom filter sized for the amount of trigrams in
+ * it, using BLOOM_BITS bits for each one.
+ */
+#ifndef BLOOM_BITS
+#define BLOOM_BITS 4
+#endif /* !BLOOM_BITS */
+
+struct trigrams {
+    uint64_t bits[(1 << 24) / 64];
+    size_t   count;
+};
+
+/* Adds the trigrams in a piece of a line, "state" is zero at line starts. */
+void trigrams_add (struct trigrams *set, const void *data, size_t size, uint32_t *state);
+
+/* Writes the filter for a set of trigrams to a file, and clears the set. */
+bool trigrams_save (struct trigrams *set, int fd);
+
+struct bloom;
+
+struct bloom* bloom_load (int fd);
+void bloom_free (struct bloom *bloom);
+
+/* Checks whether some text may appear in the file of a filter. */
+bool bloom_check (const struct bloom *bloom, const void *text, size_t size);
+
+#endif /* !__bloom_h__ */
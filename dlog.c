@@ -5,11 +5,13 @@
  * Distributed under terms of the MIT license.
  */
 
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 
 #include "deps/cflag/cflag.h"
 #include "deps/clog/clog.h"
 #include "deps/dbuf/dbuf.h"
+#include "tstamp.h"
 #include "util.h"
 #include <assert.h>
 #include <errno.h>
@@ -19,27 +21,73 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
+#include <poll.h>
 #include <time.h>
 
 #if !(defined(MULTICALL) && MULTICALL)
 # define dlog_main main
 #endif /* MULTICALL */
 
-#ifndef TSTAMP_FMT
-#define TSTAMP_FMT "%Y-%m-%d/%H:%M:%S"
-#endif /* !TSTAMP_FMT */
 
-#ifndef TSTAMP_LEN
-#define TSTAMP_LEN (5 + 3 + 3 + 3 + 3 + 3)
-#endif /* !TSTAMP_LEN */
+#ifndef INPUT_READ_SIZE
+#define INPUT_READ_SIZE (64 * 1024)
+#endif /* !INPUT_READ_SIZE */
 
+enum sync_mode {
+    SYNC_NONE,
+    SYNC_BATCH,
+    SYNC_DSYNC,
+};
 
 static bool  timestamp  = false;
 static bool  skip_empty = false;
 static bool  buffered   = false;
 static char *prefix     = NULL;
+static size_t prefix_len = 0;
 static int   log_fd     = -1;
+static bool  log_sync   = false;
+static const char *log_path = NULL;
 static int   in_fd      = STDIN_FILENO;
+static size_t maxline   = 0;
+static char *continuation = LINE_CONTINUATION;
+static size_t   batchsize = 0;
+static unsigned batchmsec = 0;
+static unsigned syncmode  = SYNC_BATCH;
+
+static struct tstamp tstamp = TSTAMP_INIT;
+
+static struct dbuf overflow = DBUF_INIT;
+static struct dbuf linebuf = DBUF_INIT;
+static struct dbuf batch = DBUF_INIT;
+static struct timespec batch_first;
+
+/* Signals are blocked except while waiting for input. */
+static sigset_t wait_mask;
+static volatile sig_atomic_t reopen_pending = 0;
+static volatile sig_atomic_t quit_pending = 0;
+
+
+static enum cflag_status
+sync_option (const struct cflag *spec, const char *arg)
+{
+    if (!spec)
+        return CFLAG_NEEDS_ARG;
+
+    static const char *modes[] = {
+        [SYNC_NONE]  = "none",
+        [SYNC_BATCH] = "batch",
+        [SYNC_DSYNC] = "dsync",
+    };
+
+    for (unsigned i = 0; i < sizeof (modes) / sizeof (modes[0]); i++) {
+        if (!strcmp (arg, modes[i])) {
+            *((unsigned*) spec->data) = i;
+            return CFLAG_OK;
+        }
+    }
+    return CFLAG_BAD_FORMAT;
+}
 
 
 static const struct cflag dlog_options[] = {
@@ -49,10 +97,35 @@ static const struct cflag dlog_options[] = {
         "File descriptor to read input from (default: stdin)."),
     CFLAG(bool, "buffered", 'b', &buffered,
         "Buffered operation, do not use flush to disk after each line."),
+    {
+        .name = "sync", .letter = 's',
+        .func = sync_option,
+        .data = &syncmode,
+        .help =
+            "How to flush to disk: 'none', 'batch' (after writing each "
+            "batch, default), or 'dsync' (open the log with O_DSYNC).",
+    },
+    CFLAG(bytes, "batch-size", 'B', &batchsize,
+        "Write lines in batches of up to this amount of data (suffixes: kmg)."),
+    CFLAG(uint, "batch-interval", 'I', &batchmsec,
+        "Write batches at most this many milliseconds after their first line."),
     CFLAG(bool, "timestamp", 't', &timestamp,
         "Prepend a timestamp in YYYY-MM-DD/HH:MM:SS format to each line."),
+    {
+        .name = "timestamp-format", .letter = 'F',
+        .func = tstamp_format_option,
+        .data = &tstamp,
+        .help =
+            "Timestamp format: 'default', 'tai64n', 'rfc3339-us', "
+            "'rfc3339-ns', or 'epoch-ns'. Formats other than 'default' "
+            "imply --timestamp.",
+    },
     CFLAG(bool, "skip-empty", 'e', &skip_empty,
         "Ignore empty lines with no characters."),
+    CFLAG(bytes, "max-line", 'L', &maxline,
+        "Split lines longer than this amount of bytes (suffixes: kmg)."),
+    CFLAG(string, "continuation", 'C', &continuation,
+        "Mark added at the end of split lines (default: '" LINE_CONTINUATION "')."),
     CFLAG_HELP,
     CFLAG_END
 };
@@ -61,21 +134,188 @@ static const struct cflag dlog_options[] = {
 static void
 handle_signal (int signum)
 {
-    if (log_fd >= 0 && log_fd != STDOUT_FILENO && log_fd != STDERR_FILENO && !isatty(log_fd)) {
-        if (safe_fsync(log_fd) == -1)
-            clog_warning("Flushing log: %s", strerror(errno));
-        if (safe_close(log_fd) == -1)
-            clog_warning("Closing log: %s", strerror(errno));
-        log_fd = -1;
-    }
-
     /*
-     * When handling HUP, we just sync and close the log file; in
+     * When handling HUP, we just sync and reopen the log file; in
      * other cases (INT, TERM) we have to exit gracefully, too.
      */
-    if (signum != SIGHUP) {
-        exit (EXIT_SUCCESS);
+    if (signum == SIGHUP)
+        reopen_pending = 1;
+    else
+        quit_pending = 1;
+}
+
+
+/*
+ * The type of the output is checked once when it is opened: only regular
+ * files are flushed to disk, which is pointless for terminals and pipes.
+ * Standard output is never flushed, as it is shared with other programs.
+ */
+static void
+open_log (const char *argv0)
+{
+    if (!log_path) {
+        log_fd = STDOUT_FILENO;
+        log_sync = false;
+        return;
     }
+
+    const int flags = O_CREAT | O_APPEND | O_WRONLY | (syncmode == SYNC_DSYNC ? O_DSYNC : 0);
+    if ((log_fd = safe_openatm(AT_FDCWD, log_path, flags, 0666)) < 0)
+        die ("%s: cannot open '%s': %s\n", argv0, log_path, ERRSTR);
+
+    struct stat st;
+    log_sync = fstat (log_fd, &st) == 0 && S_ISREG (st.st_mode);
+}
+
+
+static void
+flush_batch (void)
+{
+    if (dbuf_empty (&batch))
+        return;
+
+    struct iovec iov = iov_from_buffer (&batch);
+    const ssize_t total = dbuf_size (&batch);
+    if (writev_all(log_fd, &iov, 1) != total)
+        clog_warning("Writing to log: %s", strerror(errno));
+
+    if (log_sync && syncmode == SYNC_BATCH && safe_fdatasync(log_fd) != 0)
+        clog_warning("Flushing log: %s", strerror(errno));
+
+    dbuf_clear (&batch);
+}
+
+
+static void
+close_log (void)
+{
+    flush_batch ();
+
+    if (!log_path || log_fd < 0)
+        return;
+
+    if (log_sync && syncmode != SYNC_DSYNC && safe_fsync(log_fd) == -1)
+        clog_warning("Flushing log: %s", strerror(errno));
+    if (safe_close(log_fd) == -1)
+        clog_warning("Closing log: %s", strerror(errno));
+    log_fd = -1;
+}
+
+
+/*
+ * Adds the lines accumulated in the line buffer to the batch, with the
+ * timestamp and prefix in front of each one. Batches are written once
+ * they reach --batch-size, or right away if no batching was requested;
+ * wait_input() writes them when they get older than --batch-interval.
+ */
+static void
+batch_lines (const char *argv0)
+{
+    const uint8_t *data = dbuf_cdata(&linebuf);
+    const size_t size = dbuf_size(&linebuf);
+    const bool was_empty = dbuf_empty (&batch);
+
+    if (!timestamp && !prefix && !skip_empty) {
+        buffer_append (&batch, data, size);
+    } else {
+        size_t timebuf_len = 0;
+
+        if (timestamp) {
+            struct timespec now;
+            tstamp_clock (&tstamp, &now);
+            if ((timebuf_len = tstamp_update (&tstamp, &now)) == 0)
+                die ("%s: cannot format timestamp: %s\n", argv0, ERRSTR);
+        }
+
+        for (size_t pos = 0; pos < size;) {
+            const uint8_t *nl = memchr(data + pos, '\n', size - pos);
+            const size_t len = nl ? (size_t) (nl - (data + pos) + 1) : size - pos;
+
+            if (!(skip_empty && data[pos] == '\n')) {
+                if (timestamp)
+                    buffer_append (&batch, tstamp.buf, timebuf_len);
+                if (prefix) {
+                    buffer_append (&batch, prefix, prefix_len);
+                    buffer_append (&batch, " ", 1);
+                }
+                buffer_append (&batch, data + pos, len);
+            }
+            pos += len;
+        }
+    }
+    dbuf_clear (&linebuf);
+
+    if (was_empty && !dbuf_empty (&batch))
+        clock_gettime (CLOCK_MONOTONIC, &batch_first);
+
+    if ((!batchsize && !batchmsec) || (batchsize && dbuf_size (&batch) >= batchsize))
+        flush_batch ();
+}
+
+
+NORETURN static void
+quit (const char *argv0)
+{
+    dbuf_addbuf (&linebuf, &overflow);
+    dbuf_clear (&overflow);
+    batch_lines (argv0);
+    close_log ();
+    exit (EXIT_SUCCESS);
+}
+
+
+/*
+ * Waits for input to be available, writing the pending batch when it gets
+ * older than --batch-interval, or as soon as no more input is available
+ * when no interval was given. Signals are only delivered while waiting,
+ * so they are handled in between reading and writing lines.
+ */
+static void
+wait_input (const char *argv0)
+{
+    for (;;) {
+        if (quit_pending)
+            quit (argv0);
+        if (reopen_pending) {
+            reopen_pending = 0;
+            close_log ();
+            open_log (argv0);
+        }
+
+        struct timespec timeout, *timeoutp = NULL;
+        if (!dbuf_empty (&batch)) {
+            const unsigned long long elapsed = msec_since (&batch_first);
+            if (batchmsec && elapsed >= batchmsec) {
+                flush_batch ();
+            } else {
+                const unsigned long long remaining = batchmsec ? batchmsec - elapsed : 0;
+                timeout.tv_sec = remaining / 1000;
+                timeout.tv_nsec = (remaining % 1000) * 1000000;
+                timeoutp = &timeout;
+            }
+        }
+
+        struct pollfd pfd = { .fd = in_fd, .events = POLLIN };
+        const int r = ppoll (&pfd, 1, timeoutp, &wait_mask);
+        if (r > 0)
+            return;
+        if (r == 0)
+            flush_batch ();
+        else if (errno != EINTR)
+            die ("%s: error waiting for input: %s\n", argv0, ERRSTR);
+    }
+}
+
+
+/* Reads once, appending to the overflow buffer, returns like read(). */
+static ssize_t
+read_input (void)
+{
+    const size_t size = dbuf_size (&overflow);
+    buffer_reserve (&overflow, INPUT_READ_SIZE);
+    const ssize_t r = safe_read (in_fd, dbuf_data (&overflow) + size, INPUT_READ_SIZE);
+    overflow.size = size + (r > 0 ? r : 0);
+    return r;
 }
 
 
@@ -84,23 +324,39 @@ dlog_main (int argc, char **argv)
 {
     clog_init(NULL);
 
-    struct dbuf overflow = DBUF_INIT;
-    struct dbuf linebuf = DBUF_INIT;
     char *env_opts = NULL;
     struct sigaction sa;
+    sigset_t signals;
 
     if ((env_opts = getenv ("DLOG_OPTIONS")) != NULL)
         replace_args_string (env_opts, &argc, &argv);
 
     const char *argv0 = cflag_apply(dlog_options, "[options] [logfile-path]", &argc, &argv);
 
-    if (!argc) {
-        log_fd = STDOUT_FILENO;
-    } else if (safe_close(STDOUT_FILENO) == -1) {
-		clog_warning("Closing stdout: %s", strerror(errno));
+    if (tstamp.format != TSTAMP_DEFAULT)
+        timestamp = true;
+    if (buffered)
+        syncmode = SYNC_NONE;
+    if (prefix)
+        prefix_len = strlen (prefix);
+
+    if (in_fd < 0)
+        die ("%s: invalid input file descriptor %d\n", argv0, in_fd);
+
+    if (argc) {
+        log_path = argv[0];
+        if (safe_close(STDOUT_FILENO) == -1)
+            clog_warning("Closing stdout: %s", strerror(errno));
     }
+    open_log (argv0);
+
+    sigemptyset (&signals);
+    sigaddset (&signals, SIGHUP);
+    sigaddset (&signals, SIGINT);
+    sigaddset (&signals, SIGTERM);
+    sigprocmask (SIG_BLOCK, &signals, &wait_mask);
 
-    sigemptyset (&sa.sa_mask);
+    sa.sa_mask = signals;
     sa.sa_flags = 0;
 
     sa.sa_handler = handle_signal;
@@ -113,58 +369,22 @@ dlog_main (int argc, char **argv)
     safe_sigaction ("TERM", SIGTERM, &sa);
 
     for (;;) {
-        ssize_t bytes = freadline (in_fd, &linebuf, &overflow, 0);
+        wait_input (argv0);
+
+        const ssize_t bytes = read_input ();
         if (bytes == 0)
             break; /* EOF */
 
         if (bytes < 0)
             die ("%s: error reading input: %s\n", argv0, ERRSTR);
 
-        if (!skip_empty || dbuf_size(&linebuf) > 1) {
-            struct iovec iov[5];
-            int n_iov = 0;
-
-            char timebuf[TSTAMP_LEN+1];
-            size_t timebuf_len;
-            if (timestamp) {
-                time_t now = time(NULL);
-                struct tm *time_gm = gmtime (&now);
-
-                if ((timebuf_len = strftime (timebuf, TSTAMP_LEN+1, TSTAMP_FMT, time_gm)) == 0)
-                    die ("%s: cannot format timestamp: %s\n", argv0, ERRSTR);
-
-                iov[n_iov++] = iov_from_data (timebuf, timebuf_len);
-                iov[n_iov++] = iov_from_literal (" ");
-            }
-
-            if (prefix) {
-                iov[n_iov++] = iov_from_string (prefix);
-                iov[n_iov++] = iov_from_literal (" ");
-            }
-
-            iov[n_iov++] = iov_from_buffer (&linebuf);
-
-            assert ((unsigned) n_iov <= (sizeof (iov) / sizeof (iov[0])));
-
-            if (log_fd < 0) {
-                if ((log_fd = safe_openatm(AT_FDCWD, argv[0], O_CREAT | O_APPEND | O_WRONLY, 0666)) < 0)
-                    die ("%s: cannot open '%s': %s\n", argv0, argv[0], ERRSTR);
-            }
-
-            if (safe_writev(log_fd, iov, n_iov) < 0)
-                clog_warning("Writing to log: %s", strerror(errno));
-
-            if (!buffered && log_fd != STDOUT_FILENO && log_fd != STDERR_FILENO && !isatty(log_fd)) {
-                if (safe_fsync(log_fd) != 0)
-                    clog_warning("Flushing log: %s", strerror(errno));
-            }
+        /* Only look for lines in the overflow when new ones may be there. */
+        const uint8_t *data = dbuf_cdata (&overflow) + dbuf_size (&overflow) - bytes;
+        if (memchr (data, '\n', bytes) || (maxline && dbuf_size (&overflow) >= maxline)) {
+            drainlines_max (&linebuf, &overflow, maxline, continuation);
+            batch_lines (argv0);
         }
-        dbuf_clear(&linebuf);
     }
 
-    if (log_fd >= 0 && safe_close(log_fd) == -1)
-        clog_warning("Closing log: %s", strerror(errno));
-
-    exit (EXIT_SUCCESS);
+    quit (argv0);
 }
-
@@ -20,6 +20,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -27,6 +28,7 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <time.h>
 
 
@@ -34,8 +36,34 @@
 # define dmon_main main
 #endif /* !MULTICALL */
 
+#ifndef RELAY_DEFSIZE
+#define RELAY_DEFSIZE (64 * 1024) /* 64 kB */
+#endif /* !RELAY_DEFSIZE */
+
+#ifndef RELAY_READSIZE
+#define RELAY_READSIZE 4096
+#endif /* !RELAY_READSIZE */
+
+#ifndef RELAY_MAXREADS
+#define RELAY_MAXREADS 16
+#endif /* !RELAY_MAXREADS */
+
+#ifndef REEXEC_STATE_ENV
+#define REEXEC_STATE_ENV "DMON_REEXEC_STATE_FD"
+#endif /* !REEXEC_STATE_ENV */
+
+#define REEXEC_STATE_VERSION 1
+
+
+typedef enum {
+    OVERLOAD_BLOCK = 0,
+    OVERLOAD_DROP_NEWEST,
+    OVERLOAD_DROP_OLDEST,
+} overload_t;
+
 
 static int           log_fds[2]   = { -1, -1 };
+static int           relay_fds[2] = { -1, -1 };
 static FILE         *status_file  = NULL;
 static task_t        cmd_task     = TASK;
 static task_t        log_task     = TASK;
@@ -54,6 +82,16 @@ static bool          nodaemon     = false;
 static char         *status_path  = NULL;
 static char         *pidfile_path = NULL;
 static char         *workdir_path = NULL;
+static overload_t    log_overload = OVERLOAD_BLOCK;
+static size_t        relay_size   = RELAY_DEFSIZE;
+static struct dbuf   relay_buf    = DBUF_INIT;
+static unsigned long relay_drops  = 0;
+static bool          relay_skip   = false;
+static bool          relay_midln  = false;
+static int           reexec_sig   = NO_SIGNAL;
+static int           reexec       = 0;
+static int           reexec_cwd   = -1;
+static char        **reexec_argv  = NULL;
 
 
 static const struct {
@@ -79,6 +117,7 @@ static const struct {
 
 #define log_enabled   (log_fds[0] != -1)
 #define load_enabled  (!almost_zerof (load_high))
+#define relay_enabled (relay_fds[0] != -1)
 
 
 __attribute__((format (printf, 1, 2)))
@@ -143,6 +182,396 @@ signal_to_name (int signum)
     return unknown;
 }
 
+/*
+ * When a lossy overload policy is in use, the output of the command is not
+ * piped directly into the log command: dmon reads it from relay_fds[0] and
+ * queues it in relay_buf, from where it is written into log_fds[1]. Both
+ * ends are non-blocking, and when the queue would grow past relay_size
+ * whole lines are discarded, either the incoming ones (drop-newest) or the
+ * oldest queued ones (drop-oldest). A marker line with the count of lines
+ * dropped is inserted in the stream at the point where the gap happened.
+ *
+ * Only complete lines are written to the log command, which means that a
+ * trailing partial line may always be dropped. Writes may still end in the
+ * middle of a line (relay_midln) and then the first queued line cannot be
+ * dropped anymore.
+ */
+
+static inline size_t
+relay_complete_size (void)
+{
+    if (dbuf_empty (&relay_buf))
+        return 0;
+
+    const uint8_t *nl = memrchr (dbuf_cdata (&relay_buf), '\n',
+                                 dbuf_size (&relay_buf));
+    return nl ? (size_t) (nl - dbuf_cdata (&relay_buf) + 1) : 0;
+}
+
+
+#define RELAY_MARKSIZE 64
+
+static inline size_t
+relay_mark (char mark[RELAY_MARKSIZE])
+{
+    return snprintf (mark, RELAY_MARKSIZE, "dmon: %lu lines dropped\n",
+                     relay_drops);
+}
+
+
+static bool
+relay_make_room (size_t needed)
+{
+    const size_t size = dbuf_size (&relay_buf);
+
+    if (size + needed <= relay_size)
+        return true;
+    if (log_overload != OVERLOAD_DROP_OLDEST)
+        return false;
+
+    uint8_t *data = dbuf_data (&relay_buf);
+    size_t start = 0;
+
+    if (relay_midln) {
+        const uint8_t *nl = memchr (data, '\n', size);
+        if (!nl)
+            return false;
+        start = nl - data + 1;
+    }
+
+    /* Check first whether evicting would make enough room at all. */
+    const size_t complete = relay_complete_size ();
+    if (complete <= start || size - (complete - start) + needed > relay_size)
+        return false;
+
+    size_t end = start;
+    while (size - (end - start) + needed > relay_size) {
+        const uint8_t *nl = memchr (data + end, '\n', complete - end);
+        assert (nl);
+        end = nl - data + 1;
+        relay_drops++;
+    }
+
+    memmove (data + start, data + end, size - end);
+    relay_buf.size -= end - start;
+    return true;
+}
+
+
+static void
+relay_queue (const char *data, size_t size)
+{
+    while (size) {
+        const char *nl = memchr (data, '\n', size);
+        const size_t len = nl ? (size_t) (nl - data + 1) : size;
+        const size_t tail = relay_complete_size ();
+        const bool newline = (tail == dbuf_size (&relay_buf));
+
+        if (relay_skip) {
+            /* Discarding the rest of a line which did not fit. */
+            if (nl) {
+                relay_skip = false;
+                relay_drops++;
+            }
+        } else if (newline && relay_drops && log_overload == OVERLOAD_DROP_NEWEST) {
+            char mark[RELAY_MARKSIZE];
+            const size_t marklen = relay_mark (mark);
+            if (relay_make_room (marklen + len)) {
+                write_status ("cmd drop %lu\n", relay_drops);
+                dbuf_addmem (&relay_buf, mark, marklen);
+                dbuf_addmem (&relay_buf, data, len);
+                relay_drops = 0;
+            } else if (nl) {
+                relay_drops++;
+            } else {
+                relay_skip = true;
+            }
+        } else if (relay_make_room (len)) {
+            dbuf_addmem (&relay_buf, data, len);
+        } else {
+            /* Partial lines are never written out, it is safe to drop. */
+            relay_buf.size = relay_complete_size ();
+            if (nl)
+                relay_drops++;
+            else
+                relay_skip = true;
+        }
+
+        data += len;
+        size -= len;
+    }
+}
+
+
+static void
+relay_flush (void)
+{
+    if (!relay_midln && relay_drops && log_overload == OVERLOAD_DROP_OLDEST) {
+        char mark[RELAY_MARKSIZE];
+        const size_t marklen = relay_mark (mark);
+        /* Writes smaller than PIPE_BUF are atomic, no partial writes. */
+        if (write (log_fds[1], mark, marklen) != (ssize_t) marklen)
+            return;
+        write_status ("cmd drop %lu\n", relay_drops);
+        relay_drops = 0;
+    }
+
+    const size_t size = relay_complete_size ();
+    if (!size)
+        return;
+
+    ssize_t r;
+    do {
+        r = write (log_fds[1], dbuf_cdata (&relay_buf), size);
+    } while (r == -1 && errno == EINTR);
+
+    if (r < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            clog_warning("Writing to log process: %s.", ERRSTR);
+        return;
+    }
+
+    relay_midln = (dbuf_cdata (&relay_buf)[r - 1] != '\n');
+    relay_buf.size -= r;
+    memmove (dbuf_data (&relay_buf),
+             dbuf_data (&relay_buf) + r,
+             dbuf_size (&relay_buf));
+}
+
+
+static void
+relay_read (void)
+{
+    char chunk[RELAY_READSIZE];
+
+    for (unsigned i = 0; i < RELAY_MAXREADS; i++) {
+        ssize_t r = safe_read (relay_fds[0], chunk, sizeof (chunk));
+        if (r <= 0) {
+            if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                clog_warning("Reading command output: %s.", ERRSTR);
+            break;
+        }
+        relay_queue (chunk, r);
+    }
+}
+
+
+/*
+ * Waits for signals, or for data to relay, up to the given timeout in
+ * milliseconds (negative means no timeout).
+ */
+static void
+relay_wait (int timeout)
+{
+    struct pollfd pfd[2] = {
+        { .fd = relay_fds[0], .events = POLLIN },
+        { .fd = log_fds[1], .events = relay_complete_size () ? POLLOUT : 0 },
+    };
+
+    if (poll (pfd, 2, timeout) < 0) {
+        if (errno != EINTR)
+            clog_warning("Polling log relay: %s.", ERRSTR);
+        return;
+    }
+
+    if (pfd[0].revents & POLLIN)
+        relay_read ();
+    if (pfd[1].revents & POLLOUT || pfd[0].revents & POLLIN)
+        relay_flush ();
+}
+
+
+/*
+ * Upgrading dmon in place: the state needed to keep supervising the same
+ * child processes is written to an anonymous file which is inherited by
+ * the new binary, along with the pipes, the status file descriptor, and
+ * the directory dmon was started from.
+ * The new process finds the state file through REEXEC_STATE_ENV.
+ *
+ * All signals are blocked while re-executing: the mask is preserved by
+ * execve(), so signals which arrive in between are kept pending until the
+ * new process has its handlers installed.
+ */
+
+static int
+reexec_save (unsigned alarm_left)
+{
+#if defined(MFD_CLOEXEC)
+    int fd = memfd_create ("dmon-state", 0);
+#else
+    FILE *tmp = tmpfile ();
+    int fd = tmp ? dup (fileno (tmp)) : -1;
+    if (tmp)
+        fclose (tmp);
+#endif /* MFD_CLOEXEC */
+
+    int dupfd;
+    FILE *f;
+
+    if (fd < 0 || (dupfd = dup (fd)) < 0) {
+        clog_warning("Cannot create state file: %s.", ERRSTR);
+        goto failed;
+    }
+    if ((f = safe_fdopen (dupfd, "w")) == NULL) {
+        clog_warning("Cannot open state file: %s.", ERRSTR);
+        safe_close (dupfd);
+        goto failed;
+    }
+
+    fprintf (f, "dmon-state %i\n", REEXEC_STATE_VERSION);
+    fprintf (f, "cmd %li %lli %i\n", (long) cmd_task.pid,
+             (long long) cmd_task.started, (int) cmd_task.action);
+    fprintf (f, "log %li %lli %i\n", (long) log_task.pid,
+             (long long) log_task.started, (int) log_task.action);
+    fprintf (f, "log-fds %i %i\n", log_fds[0], log_fds[1]);
+    fprintf (f, "relay-fds %i %i\n", relay_fds[0], relay_fds[1]);
+    fprintf (f, "status-fd %i\n", status_file ? fileno (status_file) : -1);
+    fprintf (f, "cwd-fd %i\n", reexec_cwd);
+    fprintf (f, "respawns %i\n", num_respawns);
+    fprintf (f, "paused %i\n", paused);
+    fprintf (f, "alarm %u\n", alarm_left);
+    fprintf (f, "relay %i %lu %i %i %zu\n", (int) log_overload, relay_drops,
+             (int) relay_skip, (int) relay_midln, dbuf_size (&relay_buf));
+    if (!dbuf_empty (&relay_buf))
+        fwrite (dbuf_cdata (&relay_buf), 1, dbuf_size (&relay_buf), f);
+
+    if (ferror (f) | fclose (f)) {
+        clog_warning("Cannot write state file: %s.", ERRSTR);
+        goto failed;
+    }
+    if (lseek (fd, 0, SEEK_SET) < 0) {
+        clog_warning("Cannot rewind state file: %s.", ERRSTR);
+        goto failed;
+    }
+    return fd;
+
+failed:
+    if (fd >= 0)
+        safe_close (fd);
+    return -1;
+}
+
+
+static void
+reexec_inherit (bool inherit)
+{
+    void (*func)(int) = inherit ? fd_inherit : fd_cloexec;
+
+    for (unsigned i = 0; i < 2; i++) {
+        if (log_fds[i] != -1)
+            (*func) (log_fds[i]);
+        if (relay_fds[i] != -1)
+            (*func) (relay_fds[i]);
+    }
+    if (reexec_cwd != -1)
+        (*func) (reexec_cwd);
+}
+
+
+static void
+reexec_self (void)
+{
+    sigset_t all, saved;
+    sigfillset (&all);
+    sigprocmask (SIG_BLOCK, &all, &saved);
+
+    const unsigned alarm_left = alarm (0);
+
+    if (status_file)
+        fflush (status_file);
+
+    int fd = reexec_save (alarm_left);
+    if (fd >= 0) {
+        char value[24];
+        snprintf (value, sizeof (value), "%i", fd);
+        setenv (REEXEC_STATE_ENV, value, 1);
+        reexec_inherit (true);
+
+        if (reexec_cwd != -1 && fchdir (reexec_cwd) != 0)
+            clog_warning("Cannot change to initial directory: %s.", ERRSTR);
+
+        clog_debug("Re-executing %s", reexec_argv[0]);
+        execvp (reexec_argv[0], reexec_argv);
+        clog_warning("Cannot re-execute '%s': %s.", reexec_argv[0], ERRSTR);
+
+        if (workdir_path && chdir (workdir_path) != 0)
+            clog_warning("Cannot change to work directory: %s.", ERRSTR);
+
+        reexec_inherit (false);
+        unsetenv (REEXEC_STATE_ENV);
+        safe_close (fd);
+    }
+
+    alarm (alarm_left);
+    sigprocmask (SIG_SETMASK, &saved, NULL);
+}
+
+
+static bool
+reexec_restore (int fd, int *status_fd, unsigned *alarm_left)
+{
+    FILE *f = safe_fdopen (fd, "r");
+    if (!f)
+        return false;
+
+    int version, cmd_action, log_action, overload, skip, midln;
+    long cmd_pid, log_pid;
+    long long cmd_started, log_started;
+    size_t relay_len;
+
+    if (fscanf (f, "dmon-state %i\n", &version) != 1 ||
+        version != REEXEC_STATE_VERSION)
+        goto failed;
+
+    if (fscanf (f,
+                "cmd %li %lli %i\n"
+                "log %li %lli %i\n"
+                "log-fds %i %i\n"
+                "relay-fds %i %i\n"
+                "status-fd %i\n"
+                "cwd-fd %i\n"
+                "respawns %i\n"
+                "paused %i\n"
+                "alarm %u\n"
+                "relay %i %lu %i %i %zu",
+                &cmd_pid, &cmd_started, &cmd_action,
+                &log_pid, &log_started, &log_action,
+                &log_fds[0], &log_fds[1],
+                &relay_fds[0], &relay_fds[1],
+                status_fd,
+                &reexec_cwd,
+                &num_respawns,
+                &paused,
+                alarm_left,
+                &overload, &relay_drops, &skip, &midln, &relay_len) != 20 ||
+        fgetc (f) != '\n')
+        goto failed;
+
+    if (relay_len) {
+        dbuf_resize (&relay_buf, relay_len);
+        if (fread (dbuf_data (&relay_buf), 1, relay_len, f) != relay_len)
+            goto failed;
+    }
+
+    cmd_task.pid = cmd_pid;
+    cmd_task.started = cmd_started;
+    cmd_task.action = cmd_action;
+    log_task.pid = log_pid;
+    log_task.started = log_started;
+    log_task.action = log_action;
+    log_overload = overload;
+    relay_skip = skip;
+    relay_midln = midln;
+
+    fclose (f);
+    return true;
+
+failed:
+    fclose (f);
+    return false;
+}
+
+
 #if defined(__UCLIBC__)
 #include <sys/sysinfo.h>
 static int getloadavg(double *a, int n)
@@ -233,6 +662,12 @@ handle_signal (int signum)
         return;
     }
 
+    /* Re-executing is done from the main loop. */
+    if (signum == reexec_sig) {
+        reexec = 1;
+        return;
+    }
+
     /*
      * If we have a maximum time to run the process, and we receive SIGALRM,
      * then the timeout was reached. As per signal(7) it is safe to kill(2)
@@ -343,6 +778,53 @@ _store_uidgids_option (const struct cflag *spec, const char *arg)
     return status ? CFLAG_BAD_FORMAT : CFLAG_OK;
 }
 
+static enum cflag_status
+_overload_option (const struct cflag *spec, const char *arg)
+{
+    if (!spec)
+        return CFLAG_NEEDS_ARG;
+
+    static const struct {
+        const char *name;
+        overload_t  policy;
+    } policies[] = {
+        { "block",       OVERLOAD_BLOCK       },
+        { "drop-newest", OVERLOAD_DROP_NEWEST },
+        { "drop-oldest", OVERLOAD_DROP_OLDEST },
+    };
+
+    for (unsigned i = 0; i < sizeof (policies) / sizeof (policies[0]); i++) {
+        if (!strcmp (arg, policies[i].name)) {
+            *((overload_t*) spec->data) = policies[i].policy;
+            return CFLAG_OK;
+        }
+    }
+    return CFLAG_BAD_FORMAT;
+}
+
+static enum cflag_status
+_signal_option (const struct cflag *spec, const char *arg)
+{
+    if (!spec)
+        return CFLAG_NEEDS_ARG;
+
+    /*
+     * Only signals which are otherwise forwarded can be used, except those
+     * which dmon handles itself: ALRM (--timeout), CHLD, and CONT.
+     */
+    for (unsigned i = 0; forward_signals[i].code != NO_SIGNAL; i++) {
+        if (forward_signals[i].code == SIGALRM ||
+            forward_signals[i].code == SIGCHLD ||
+            forward_signals[i].code == SIGCONT)
+            continue;
+        if (!strcasecmp (arg, forward_signals[i].name)) {
+            *((int*) spec->data) = forward_signals[i].code;
+            return CFLAG_OK;
+        }
+    }
+    return CFLAG_BAD_FORMAT;
+}
+
 static enum cflag_status
 _config_option(const struct cflag *spec, const char *arg)
 {
@@ -429,6 +911,26 @@ static const struct cflag dmon_options[] = {
             "User and (optionally) groups to run the log process as. "
             "Format is 'user[:group1[:group2[:...groupN]]]'.",
     },
+    {
+        .name = "log-overload", .letter = 'O',
+        .func = _overload_option,
+        .data = &log_overload,
+        .help =
+            "What to do when the log process does not keep up with the "
+            "command output: 'block' (default), 'drop-newest', or "
+            "'drop-oldest'.",
+    },
+    CFLAG(bytes, "log-buffer", 'B', &relay_size,
+          "Amount of command output to buffer when a dropping overload "
+          "policy is used (suffixes: kmg)."),
+    {
+        .name = "reexec-signal", .letter = 'R',
+        .func = _signal_option,
+        .data = &reexec_sig,
+        .help =
+            "Signal which makes dmon re-execute itself, e.g. to upgrade "
+            "its binary, while keeping the monitored processes running.",
+    },
     CFLAG_HELP,
     CFLAG_END
 };
@@ -441,6 +943,18 @@ dmon_main (int argc, char **argv)
 
     FILE *pid_file = NULL;
     char *opts_env = NULL;
+    int state_fd = -1;
+    int status_fd = -1;
+    unsigned alarm_left = 0;
+
+    /* Keep the original arguments around, to use them to re-execute. */
+    reexec_argv = calloc (argc + 1, sizeof (char*));
+    memcpy (reexec_argv, argv, argc * sizeof (char*));
+
+    if ((opts_env = getenv (REEXEC_STATE_ENV)) != NULL) {
+        state_fd = atoi (opts_env);
+        unsetenv (REEXEC_STATE_ENV);
+    }
 
     /* Check for -C/--config given as first command line argument. */
     if (argc > 2 && ((argv[1][0] == '-' &&
@@ -466,12 +980,33 @@ dmon_main (int argc, char **argv)
                                     "log-cmd [log-cmd-options]]",
                                     &argc, &argv);
 
+    if (state_fd >= 0) {
+        if (!reexec_restore (state_fd, &status_fd, &alarm_left))
+            die ("%s: Cannot restore state after re-executing.\n", argv0);
+        /* Children may have exited in between, check them. */
+        check_child = 1;
+        reexec_inherit (false);
+    }
+
+    if (reexec_sig != NO_SIGNAL && reexec_cwd < 0) {
+        /*
+         * Relative paths given in the command line need the initial
+         * directory, which is kept open across upgrades as well.
+         */
+        if ((reexec_cwd = safe_openat (AT_FDCWD, ".", O_RDONLY | O_DIRECTORY)) < 0)
+            die ("%s: Cannot open current directory, %s\n", argv0, ERRSTR);
+        fd_cloexec (reexec_cwd);
+    }
+
     if (workdir_path) {
         if (chdir (workdir_path) != 0)
             die ("%s: Cannot use '%s' as work directory, %s\n", argv0, workdir_path, ERRSTR);
     }
 
-    if (status_path) {
+    if (status_fd >= 0) {
+        status_file = fdopen (status_fd, "a");
+        setvbuf (status_file, NULL, _IOLBF, 0);
+    } else if (status_path) {
         int fd = safe_openatm(AT_FDCWD, status_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
         if (fd < 0)
             die ("%s: Cannot open '%s' for writing, %s\n", argv0, status_path, ERRSTR);
@@ -503,13 +1038,25 @@ dmon_main (int argc, char **argv)
 
     cmd_task.argv[cmd_task.argc] = NULL;
 
-    if (log_task.argc > 0) {
+    if (log_task.argc > 0 && state_fd < 0) {
         if (pipe (log_fds) != 0) {
             die ("%s: Cannot create pipe: %s\n", argv0, ERRSTR);
         }
         clog_debug("pipe_read = %i, pipe_write = %i\n", log_fds[0], log_fds[1]);
         fd_cloexec (log_fds[0]);
         fd_cloexec (log_fds[1]);
+
+        if (log_overload != OVERLOAD_BLOCK) {
+            if (relay_size < 64)
+                die ("%s: Log buffer size is too small.\n", argv0);
+            if (pipe (relay_fds) != 0)
+                die ("%s: Cannot create pipe: %s\n", argv0, ERRSTR);
+            clog_debug("relay_read = %i, relay_write = %i\n", relay_fds[0], relay_fds[1]);
+            fd_cloexec (relay_fds[0]);
+            fd_cloexec (relay_fds[1]);
+            fd_nonblock (relay_fds[0]);
+            fd_nonblock (log_fds[1]);
+        }
     }
 
     if (clog_debug_enabled) {
@@ -534,7 +1081,7 @@ dmon_main (int argc, char **argv)
     if (cmd_task.argc == 0)
         die ("%s: No command to run given.\n", argv0);
 
-    if (pidfile_path) {
+    if (pidfile_path && state_fd < 0) {
         int fd = safe_openatm(AT_FDCWD, pidfile_path, O_TRUNC | O_CREAT | O_WRONLY, 0666);
         if (fd < 0) {
             die ("%s: cannot open '%s' for writing, %s\n",
@@ -543,7 +1090,7 @@ dmon_main (int argc, char **argv)
         pid_file = fdopen (fd, "w");
     }
 
-    if (!nodaemon)
+    if (!nodaemon && state_fd < 0)
         become_daemon ();
 
     /* We have a valid file descriptor: write PID */
@@ -555,14 +1102,27 @@ dmon_main (int argc, char **argv)
     }
 
     setup_signals ();
-    alarm (cmd_timeout);
 
-    cmd_task.write_fd = log_fds[1];
+    if (state_fd >= 0) {
+        sigset_t all;
+        sigfillset (&all);
+        alarm (alarm_left);
+        sigprocmask (SIG_UNBLOCK, &all, NULL);
+    } else {
+        alarm (cmd_timeout);
+    }
+
+    cmd_task.write_fd = relay_enabled ? relay_fds[1] : log_fds[1];
     log_task.read_fd  = log_fds[0];
 
     int retcode = 0;
     while (running) {
         clog_debug(">>> loop iteration");
+        if (reexec) {
+            reexec = 0;
+            reexec_self ();
+        }
+
         if (check_child) {
             retcode = reap_and_check ();
             clog_debug("retcode = %d", retcode);
@@ -602,7 +1162,10 @@ dmon_main (int argc, char **argv)
             double load_cur;
 
             clog_debug("Checking load after sleeping 1s");
-            interruptible_sleep (1);
+            if (relay_enabled)
+                relay_wait (1000);
+            else
+                interruptible_sleep (1);
 
             if (getloadavg (&load_cur, 1) == -1)
                 clog_debug("getloadavg() failed: %s", ERRSTR);
@@ -629,12 +1192,27 @@ dmon_main (int argc, char **argv)
         else {
             /* Wait for signals to arrive. */
             clog_debug("Waiting for signals to come...");
-            pause ();
+            if (relay_enabled)
+                relay_wait (-1);
+            else
+                pause ();
         }
     }
 
     clog_debug("Exiting gracefully...");
 
+    /* Give the log process a last chance to get pending output. */
+    if (relay_enabled) {
+        relay_read ();
+        if (relay_drops && log_overload == OVERLOAD_DROP_NEWEST) {
+            char mark[RELAY_MARKSIZE];
+            dbuf_addmem (&relay_buf, mark, relay_mark (mark));
+            write_status ("cmd drop %lu\n", relay_drops);
+            relay_drops = 0;
+        }
+        relay_flush ();
+    }
+
     if (cmd_task.pid != NO_PID) {
         write_status ("cmd stop %li\n", (long) cmd_task.pid);
         task_action (&cmd_task, A_STOP);
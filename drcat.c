@@ -0,0 +1,278 @@
+/*
+ * drcat.c
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE
+
+#include "deps/cflag/cflag.h"
+#include "logfile.h"
+#include "tstamp.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if !(defined(MULTICALL) && MULTICALL)
+# define drcat_main main
+#endif /* MULTICALL */
+
+/*
+ * Lines written right before a rotation may get a timestamp slightly
+ * older than the name of the rotated file, and end up in the next one.
+ */
+#ifndef ROTATE_SLACK
+#define ROTATE_SLACK 1000000ULL /* Microseconds */
+#endif /* !ROTATE_SLACK */
+
+
+static unsigned long long since = 0;
+static unsigned long long until = ULLONG_MAX;
+
+static unsigned long long
+now_usec (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * Times can be given in any of the timestamp formats written by drlog,
+ * leaving out the time of day or the seconds, or as an amount of time
+ * before now prefixed with a minus sign (e.g. "-5m"). The span is the
+ * amount of time covered, e.g. a whole day if only the date is given.
+ */
+static bool
+parse_time (const char *arg, unsigned long long *result, unsigned long long *span)
+{
+    if (*arg == '-') {
+        unsigned long long secs;
+        const struct cflag interval = { .data = &secs };
+        if (cflag_timei (&interval, arg + 1) != CFLAG_OK)
+            return false;
+        *result = now_usec () - secs * 1000000ULL;
+        *span = 1;
+        return true;
+    }
+
+    char text[TSTAMP_MAXLEN];
+    size_t len = strlen (arg);
+    if (len >= sizeof (text) - sizeof ("T00:00:00"))
+        return false;
+
+    memcpy (text, arg, len + 1);
+    if (len == 10) {
+        len += sprintf (text + len, "T00:00:00");
+        *span = 24 * 60 * 60 * 1000000ULL;
+    } else if (len == 16) {
+        len += sprintf (text + len, ":00");
+        *span = 60 * 1000000ULL;
+    } else {
+        *span = strchr (text, '.') ? 1 : 1000000ULL;
+    }
+
+    struct timespec ts;
+    if (tstamp_parse (text, len, &ts) != len)
+        return false;
+
+    *result = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    return true;
+}
+
+
+static enum cflag_status
+since_option (const struct cflag *spec, const char *arg)
+{
+    if (!spec)
+        return CFLAG_NEEDS_ARG;
+
+    unsigned long long span;
+    return parse_time (arg, spec->data, &span) ? CFLAG_OK : CFLAG_BAD_FORMAT;
+}
+
+
+static enum cflag_status
+until_option (const struct cflag *spec, const char *arg)
+{
+    if (!spec)
+        return CFLAG_NEEDS_ARG;
+
+    unsigned long long *result = spec->data, span;
+    if (!parse_time (arg, result, &span))
+        return CFLAG_BAD_FORMAT;
+
+    /* Up to the end of the span, e.g. the whole second. */
+    *result += span - 1;
+    return CFLAG_OK;
+}
+
+
+static void
+output (const uint8_t *data, size_t size)
+{
+    struct iovec iov = iov_from_data ((void*) data, size);
+    if (size && writev_all(STDOUT_FILENO, &iov, 1) < 0)
+        die ("Cannot write output: %s\n", ERRSTR);
+}
+
+
+/*
+ * Writes the lines of a block whose timestamps are in the time range,
+ * and those without a timestamp.
+ */
+static void
+output_lines (const uint8_t *data, size_t size)
+{
+    size_t pos = 0, start = 0;
+
+    while (pos < size) {
+        const uint8_t *nl = memchr (data + pos, '\n', size - pos);
+        const size_t len = nl ? (size_t) (nl - (data + pos) + 1) : size - pos;
+
+        struct timespec ts;
+        if (tstamp_parse ((const char*) data + pos, len - (nl != NULL), &ts)) {
+            const unsigned long long t = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+            /* Seconds in timestamps without a fraction are ranges. */
+            if (t + (ts.tv_nsec ? 0 : 999999) < since || t > until) {
+                output (data + start, pos - start);
+                start = pos + len;
+            }
+        }
+        pos += len;
+    }
+    output (data + start, pos - start);
+}
+
+
+/*
+ * Writes the part of a file in the time range, knowing that its lines
+ * were written between "lower" and "upper". Each block between entries
+ * of the index is written as a whole when all of it is in the range,
+ * skipped when none of it is, and otherwise filtered line by line.
+ */
+static void
+cat_file (int dirfd, const char *name, unsigned long long lower, unsigned long long upper)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = safe_openat(dirfd, name, O_RDONLY | O_CLOEXEC)) < 0) {
+        /* Rotated or pruned after listing the directory. */
+        if (errno != ENOENT)
+            fprintf (stderr, "Cannot open '%s': %s.\n", name, ERRSTR);
+        return;
+    }
+    if (fstat (fd, &st) < 0 || st.st_size == 0) {
+        safe_close(fd);
+        return;
+    }
+
+    const size_t size = st.st_size;
+    const uint8_t *data = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    safe_close(fd);
+    if (data == MAP_FAILED)
+        die ("Cannot map '%s': %s\n", name, ERRSTR);
+    madvise ((void*) data, size, MADV_SEQUENTIAL);
+
+    size_t n = 0;
+    struct logindex_entry *entries = logindex_read (dirfd, name, size, &n);
+
+    /* First entry not older than "since", the block before it is the first. */
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].time < since)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (size_t i = lo; i <= n; i++) {
+        const size_t start = i ? entries[i - 1].offset : 0;
+        const size_t end = (i < n) ? entries[i].offset : size;
+        const unsigned long long tmin = i ? entries[i - 1].time : lower;
+        const unsigned long long tmax = (i < n) ? entries[i].time : upper;
+
+        if (tmin > until)
+            break;
+        if (start >= end)
+            continue;
+
+        if (tmin >= since && tmax <= until)
+            output (data + start, end - start);
+        else
+            output_lines (data + start, end - start);
+    }
+
+    free (entries);
+    munmap ((void*) data, size);
+}
+
+
+int
+drcat_main (int argc, char **argv)
+{
+    const struct cflag drcat_options[] = {
+        { .name = "since", .letter = 's', .func = since_option, .data = &since,
+          .help = "Show lines written at this time or later." },
+        { .name = "until", .letter = 'u', .func = until_option, .data = &until,
+          .help = "Show lines written at this time or earlier." },
+        CFLAG_HELP,
+        CFLAG_END
+    };
+
+    const char *argv0 = cflag_apply(drcat_options, "[options] logdir-path", &argc, &argv);
+
+    if (!argc)
+        die ("%s: No log directory path was specified.\n", argv0);
+    if (argc > 1)
+        die ("%s: Only one log directory can be read.\n", argv0);
+
+    const int dirfd = safe_openat(AT_FDCWD, argv[0], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+        die ("%s: Unable to open directory '%s': %s\n", argv0, argv[0], ERRSTR);
+
+    size_t n;
+    struct logfile_entry *files = logfile_list (dirfd, argv[0], &n);
+
+    /*
+     * Each file has the lines written after the previous one was rotated,
+     * and before its own rotation time, which is part of its name.
+     */
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (files[mid].key < since)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (size_t i = lo; i < n; i++) {
+        const unsigned long long lower = (i && files[i - 1].key > ROTATE_SLACK)
+            ? files[i - 1].key - ROTATE_SLACK : 0;
+        if (lower > until)
+            break;
+
+        if (files[i].key != ULLONG_MAX && !logfile_plain (files[i].name))
+            fprintf (stderr, "%s: Skipping '%s/%s', not a plain log file.\n",
+                     argv0, argv[0], files[i].name);
+        else
+            cat_file (dirfd, files[i].name, lower, files[i].key);
+    }
+
+    exit (EXIT_SUCCESS);
+}
+
+/* vim: expandtab shiftwidth=4 tabstop=4
+ */
@@ -0,0 +1,468 @@
+/*
+ * drgrep.c
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE
+
+#include "deps/cflag/cflag.h"
+#include "bloom.h"
+#include "logfile.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if !(defined(MULTICALL) && MULTICALL)
+# define drgrep_main main
+#endif /* MULTICALL */
+
+#ifndef UNIT_SIZE
+#define UNIT_SIZE (4 * 1024 * 1024) /* Bytes searched by a thread at once */
+#endif /* !UNIT_SIZE */
+
+#ifndef OUTPUT_IOV
+#define OUTPUT_IOV 1024
+#endif /* !OUTPUT_IOV */
+
+
+static bool     ignore_case = false;
+static bool     list_files  = false;
+static bool     count_only  = false;
+static bool     show_stats  = false;
+static unsigned jobs        = 0;
+
+static const uint8_t *needle = NULL;
+static size_t         needle_len = 0;
+
+
+/*
+ * Files are searched in parts of about UNIT_SIZE bytes, ending at line
+ * boundaries, by a pool of threads. Each part keeps the ranges of lines
+ * which match, and the main thread writes them in order as the parts
+ * are completed, so the output is the same as for a sequential search.
+ */
+struct source {
+    char          *path;
+    const uint8_t *data;
+    size_t         size;
+    _Atomic bool   matched;
+};
+
+struct range {
+    size_t start;
+    size_t end;
+};
+
+struct unit {
+    struct source *source;
+    size_t         start;
+    size_t         end;
+    struct range  *ranges;
+    size_t         n_ranges;
+    size_t         alloc;
+    size_t         matches;
+    bool           done;
+};
+
+static struct {
+    struct unit    *items;
+    size_t          count;
+    size_t          alloc;
+    _Atomic size_t  next;
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+} units = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+
+static inline uint8_t
+fold (uint8_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+
+static bool
+needle_at (const uint8_t *p)
+{
+    if (!ignore_case)
+        return !memcmp (p, needle, needle_len);
+
+    for (size_t i = 0; i < needle_len; i++)
+        if (fold (p[i]) != needle[i])
+            return false;
+    return true;
+}
+
+
+#if defined(__GNUC__)
+/*
+ * Compares the bytes where the first and last bytes of the needle would
+ * be for a whole vector of positions at once, and only checks the rest
+ * of the needle at the positions where both match. GCC vector extensions
+ * get compiled to whatever SIMD instructions the target has.
+ */
+#define VEC_SIZE 16
+typedef uint8_t vec_t __attribute__((vector_size (VEC_SIZE)));
+
+static inline vec_t
+vec_load (const uint8_t *p)
+{
+    vec_t v;
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+
+static inline vec_t
+vec_fill (uint8_t c)
+{
+    vec_t v;
+    memset (&v, c, sizeof (v));
+    return v;
+}
+
+
+static inline vec_t
+vec_match (vec_t v, vec_t lower, vec_t upper)
+{
+    return (vec_t) (v == lower) | (vec_t) (v == upper);
+}
+#endif /* __GNUC__ */
+
+
+static const uint8_t*
+find_needle (const uint8_t *p, const uint8_t *end)
+{
+    if ((size_t) (end - p) < needle_len)
+        return NULL;
+
+    if (needle_len == 1 && !ignore_case)
+        return memchr (p, needle[0], end - p);
+
+    const uint8_t *last = end - needle_len + 1; /* Last start position, plus one */
+
+#if defined(__GNUC__)
+    if (needle_len > 1) {
+        const uint8_t first = needle[0], final = needle[needle_len - 1];
+        const vec_t first_lo = vec_fill (first), final_lo = vec_fill (final);
+        const vec_t first_up = vec_fill (ignore_case && first >= 'a' && first <= 'z' ? first & ~0x20 : first);
+        const vec_t final_up = vec_fill (ignore_case && final >= 'a' && final <= 'z' ? final & ~0x20 : final);
+
+        for (; p + VEC_SIZE <= last; p += VEC_SIZE) {
+            const vec_t mask = vec_match (vec_load (p), first_lo, first_up) &
+                vec_match (vec_load (p + needle_len - 1), final_lo, final_up);
+
+            uint64_t words[VEC_SIZE / 8];
+            memcpy (words, &mask, sizeof (words));
+            for (unsigned w = 0; w < VEC_SIZE / 8; w++) {
+                if (!words[w])
+                    continue;
+                for (unsigned i = w * 8; i < w * 8 + 8; i++)
+                    if (mask[i] && needle_at (p + i))
+                        return p + i;
+            }
+        }
+    }
+#endif /* __GNUC__ */
+
+    if (!ignore_case)
+        return memmem (p, end - p, needle, needle_len);
+
+    for (; p < last; p++)
+        if (fold (*p) == needle[0] && needle_at (p))
+            return p;
+    return NULL;
+}
+
+
+static void
+search_unit (struct unit *u)
+{
+    const uint8_t *data = u->source->data;
+    const uint8_t *p = data + u->start, *end = data + u->end;
+
+    while (p < end) {
+        if (list_files && atomic_load (&u->source->matched))
+            break;
+
+        const uint8_t *hit = find_needle (p, end);
+        if (!hit)
+            break;
+
+        /* Units start at line boundaries, and "p" is always at one. */
+        const uint8_t *nl = memrchr (p, '\n', hit - p);
+        const size_t start = nl ? (size_t) (nl + 1 - data) : (size_t) (p - data);
+        nl = memchr (hit, '\n', end - hit);
+        p = nl ? nl + 1 : end;
+
+        u->matches++;
+        if (list_files) {
+            atomic_store (&u->source->matched, true);
+            break;
+        }
+        if (count_only)
+            continue;
+
+        if (u->n_ranges && u->ranges[u->n_ranges - 1].end == start) {
+            u->ranges[u->n_ranges - 1].end = p - data;
+            continue;
+        }
+        if (u->n_ranges == u->alloc) {
+            u->alloc = u->alloc ? u->alloc * 2 : 16;
+            if ((u->ranges = reallocarray (u->ranges, u->alloc, sizeof (struct range))) == NULL)
+                die ("Cannot allocate memory\n");
+        }
+        u->ranges[u->n_ranges++] = (struct range) { .start = start, .end = p - data };
+    }
+}
+
+
+static void*
+search_worker (void *arg)
+{
+    (void) arg;
+
+    size_t i;
+    while ((i = atomic_fetch_add (&units.next, 1)) < units.count) {
+        search_unit (&units.items[i]);
+
+        pthread_mutex_lock (&units.lock);
+        units.items[i].done = true;
+        pthread_cond_broadcast (&units.done);
+        pthread_mutex_unlock (&units.lock);
+    }
+    return NULL;
+}
+
+
+static void
+add_units (struct source *source)
+{
+    size_t start = 0;
+
+    while (start < source->size) {
+        size_t end = source->size;
+        if (end - start > UNIT_SIZE) {
+            const uint8_t *nl = memchr (source->data + start + UNIT_SIZE, '\n',
+                                        source->size - start - UNIT_SIZE);
+            end = nl ? (size_t) (nl + 1 - source->data) : source->size;
+        }
+
+        if (units.count == units.alloc) {
+            units.alloc = units.alloc ? units.alloc * 2 : 64;
+            if ((units.items = reallocarray (units.items, units.alloc, sizeof (struct unit))) == NULL)
+                die ("Cannot allocate memory\n");
+        }
+        units.items[units.count++] = (struct unit) {
+            .source = source, .start = start, .end = end,
+        };
+        start = end;
+    }
+}
+
+
+static struct {
+    size_t             files;
+    size_t             skipped;
+    unsigned long long bytes;
+    unsigned long long searched;
+} stats;
+
+
+/* Maps a log file to be searched, unless its Bloom filter rules it out. */
+static struct source*
+open_source (int dirfd, const char *dir, const char *name)
+{
+    char path[NAME_MAX + 1];
+    struct stat st;
+    int fd;
+
+    stats.files++;
+    if ((fd = safe_openat(dirfd, name, O_RDONLY | O_CLOEXEC)) < 0) {
+        /* Rotated or pruned after listing the directory. */
+        if (errno != ENOENT)
+            fprintf (stderr, "Cannot open '%s/%s': %s.\n", dir, name, ERRSTR);
+        return NULL;
+    }
+    if (fstat (fd, &st) < 0 || st.st_size == 0) {
+        safe_close(fd);
+        return NULL;
+    }
+    stats.bytes += st.st_size;
+
+    int bloom_fd;
+    if (needle_len >= 3 && logfile_sidecar (path, sizeof (path), name, BLOOM_SUFFIX) &&
+        (bloom_fd = safe_openat(dirfd, path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        struct bloom *bloom = bloom_load (bloom_fd);
+        safe_close(bloom_fd);
+
+        const bool skip = bloom && !bloom_check (bloom, needle, needle_len);
+        bloom_free (bloom);
+        if (skip) {
+            safe_close(fd);
+            stats.skipped++;
+            return NULL;
+        }
+    }
+
+    struct source *source = calloc (1, sizeof (struct source));
+    if (!source || asprintf (&source->path, "%s/%s", dir, name) < 0)
+        die ("Cannot allocate memory\n");
+
+    source->size = st.st_size;
+    source->data = mmap (NULL, source->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    safe_close(fd);
+    if (source->data == MAP_FAILED)
+        die ("Cannot map '%s': %s\n", source->path, ERRSTR);
+    madvise ((void*) source->data, source->size, MADV_SEQUENTIAL);
+
+    stats.searched += source->size;
+    return source;
+}
+
+
+static void
+add_directory (const char *argv0, const char *dir)
+{
+    const int dirfd = safe_openat(AT_FDCWD, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+        die ("%s: Unable to open directory '%s': %s\n", argv0, dir, ERRSTR);
+
+    size_t n;
+    struct logfile_entry *files = logfile_list (dirfd, dir, &n);
+
+    for (size_t i = 0; i < n; i++) {
+        if (files[i].key != ULLONG_MAX && !logfile_plain (files[i].name)) {
+            fprintf (stderr, "%s: Skipping '%s/%s', not a plain log file.\n",
+                     argv0, dir, files[i].name);
+            continue;
+        }
+
+        struct source *source = open_source (dirfd, dir, files[i].name);
+        if (source)
+            add_units (source);
+    }
+
+    logfile_list_free (files, n);
+    safe_close(dirfd);
+}
+
+
+static void
+output_unit (const struct unit *u)
+{
+    struct iovec iov[OUTPUT_IOV];
+    size_t n_iov = 0;
+
+    for (size_t i = 0; i <= u->n_ranges; i++) {
+        if (n_iov == OUTPUT_IOV || (i == u->n_ranges && n_iov)) {
+            if (writev_all(STDOUT_FILENO, iov, n_iov) < 0)
+                die ("Cannot write output: %s\n", ERRSTR);
+            n_iov = 0;
+        }
+        if (i < u->n_ranges)
+            iov[n_iov++] = iov_from_data ((void*) (u->source->data + u->ranges[i].start),
+                                          u->ranges[i].end - u->ranges[i].start);
+    }
+}
+
+
+int
+drgrep_main (int argc, char **argv)
+{
+    const struct cflag drgrep_options[] = {
+        CFLAG(bool, "ignore-case", 'i', &ignore_case,
+              "Ignore the case of ASCII letters."),
+        CFLAG(bool, "files-with-matches", 'l', &list_files,
+              "Only print the paths of files with matching lines."),
+        CFLAG(bool, "count", 'c', &count_only,
+              "Only print the number of matching lines."),
+        CFLAG(uint, "jobs", 'j', &jobs,
+              "Number of threads to search with (default: one per CPU)."),
+        CFLAG(bool, "stats", '\0', &show_stats,
+              "Print how many files and bytes were searched."),
+        CFLAG_HELP,
+        CFLAG_END
+    };
+
+    const char *argv0 = cflag_apply(drgrep_options, "[options] text logdir-path...", &argc, &argv);
+
+    if (argc < 2)
+        die ("%s: No %s was specified.\n", argv0, argc ? "log directory path" : "text to search");
+
+    needle_len = strlen (argv[0]);
+    if (!needle_len)
+        die ("%s: The text to search cannot be empty.\n", argv0);
+
+    uint8_t *text = (uint8_t*) argv[0];
+    if (ignore_case)
+        for (size_t i = 0; i < needle_len; i++)
+            text[i] = fold (text[i]);
+    needle = text;
+
+    for (int i = 1; i < argc; i++)
+        add_directory (argv0, argv[i]);
+
+    if (!jobs) {
+        const long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? cpus : 1;
+    }
+    if (jobs > units.count)
+        jobs = units.count;
+
+    pthread_t *threads = calloc (jobs ? jobs : 1, sizeof (pthread_t));
+    for (unsigned i = 0; i < jobs; i++) {
+        int err = pthread_create (&threads[i], NULL, search_worker, NULL);
+        if (err)
+            die ("%s: Cannot create thread: %s\n", argv0, strerror (err));
+    }
+
+    unsigned long long matches = 0;
+    for (size_t i = 0; i < units.count; i++) {
+        struct unit *u = &units.items[i];
+
+        pthread_mutex_lock (&units.lock);
+        while (!u->done)
+            pthread_cond_wait (&units.done, &units.lock);
+        pthread_mutex_unlock (&units.lock);
+
+        matches += u->matches;
+        if (!list_files && !count_only)
+            output_unit (u);
+        free (u->ranges);
+
+        /* Files are done once their last unit is. */
+        if (i + 1 == units.count || units.items[i + 1].source != u->source) {
+            if (list_files && atomic_load (&u->source->matched))
+                printf ("%s\n", u->source->path);
+            munmap ((void*) u->source->data, u->source->size);
+        }
+    }
+
+    for (unsigned i = 0; i < jobs; i++)
+        pthread_join (threads[i], NULL);
+
+    if (count_only)
+        printf ("%llu\n", matches);
+    if (show_stats)
+        fprintf (stderr, "%s: Searched %llu of %llu bytes, %zu of %zu files skipped by Bloom filters.\n",
+                 argv0, stats.searched, stats.bytes, stats.skipped, stats.files);
+
+    exit (matches ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* vim: expandtab shiftwidth=4 tabstop=4
+ */
@@ -6,10 +6,14 @@
  * Distributed under terms of the MIT license.
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include "deps/cflag/cflag.h"
 #include "deps/dbuf/dbuf.h"
+#include "bloom.h"
+#include "logfile.h"
+#include "tstamp.h"
+#include "uring.h"
 #include "util.h"
 #include <assert.h>
 #include <time.h>
@@ -19,335 +23,2110 @@
 #include <dirent.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <poll.h>
+#include <regex.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/types.h>
-#include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<sys/signalfd.h>)
+#  include <sys/signalfd.h>
+#  define HAVE_SIGNALFD 1
+# endif
+#endif
+
+#ifndef HAVE_SIGNALFD
+#define HAVE_SIGNALFD 0
+#endif
+
 #if !(defined(MULTICALL) && MULTICALL)
 # define drlog_main main
 #endif /* MULTICALL */
 
-#ifndef LOGDIR_PERMS
-#define LOGDIR_PERMS 0750
-#endif /* !LOGDIR_PERMS */
+#ifndef LOGDIR_PERMS
+#define LOGDIR_PERMS 0750
+#endif /* !LOGDIR_PERMS */
+
+#ifndef LOGDIR_TSTAMP
+#define LOGDIR_TSTAMP ".timestamp" /* Used by older versions */
+#endif /* !LOGDIR_TSTAMP */
+
+#ifndef LOGFILE_PERMS
+#define LOGFILE_PERMS 0640
+#endif /* !LOGFILE_PERMS */
+
+#ifndef LOGFILE_XATTR
+#define LOGFILE_XATTR "user.drlog.epoch"
+#endif /* !LOGFILE_XATTR */
+
+#ifndef LOGFILE_NEXT
+#define LOGFILE_NEXT ".next"
+#endif /* !LOGFILE_NEXT */
+
+#ifndef LOGFILE_DEFMAX
+#define LOGFILE_DEFMAX 10
+#endif /* !LOGFILE_DEFMAX */
+
+#ifndef LOGFILE_DEFSIZE
+#define LOGFILE_DEFSIZE (150 * 1024) /* 150 kB */
+#endif /* !LOGFILE_DEFSIZE */
+
+#ifndef LOGINDEX_DEFSIZE
+#define LOGINDEX_DEFSIZE (64 * 1024) /* 64 kB */
+#endif /* !LOGINDEX_DEFSIZE */
+
+#ifndef LOGFILE_DEFTIME
+#define LOGFILE_DEFTIME (60 * 60 * 24 * 5) /* Five days */
+#endif /* !LOGFILE_DEFTIME */
+
+#ifndef PROCESSOR_RETRIES
+#define PROCESSOR_RETRIES 3
+#endif /* !PROCESSOR_RETRIES */
+
+#ifndef PROCESSOR_RETRY_DELAY
+#define PROCESSOR_RETRY_DELAY 10 /* Seconds, multiplied by attempts */
+#endif /* !PROCESSOR_RETRY_DELAY */
+
+#ifndef PROCESSOR_POLL_MSEC
+#define PROCESSOR_POLL_MSEC 500
+#endif /* !PROCESSOR_POLL_MSEC */
+
+#ifndef URING_RETRY_DELAY
+#define URING_RETRY_DELAY 5 /* Seconds */
+#endif /* !URING_RETRY_DELAY */
+
+#ifndef FULL_RETRY_DELAY
+#define FULL_RETRY_DELAY 1 /* Seconds */
+#endif /* !FULL_RETRY_DELAY */
+
+#ifndef FULL_BUFFER_SIZE
+#define FULL_BUFFER_SIZE (1024 * 1024) /* 1 MB */
+#endif /* !FULL_BUFFER_SIZE */
+
+#ifndef INPUT_READ_SIZE
+#define INPUT_READ_SIZE (64 * 1024) /* Bytes read at once */
+#endif /* !INPUT_READ_SIZE */
+
+#ifndef ROTATE_MAX_WAIT
+#define ROTATE_MAX_WAIT (60 * 60) /* Seconds, re-checked after this */
+#endif /* !ROTATE_MAX_WAIT */
+
+
+/* Rotation settings, copied to each log directory when it is added. */
+static unsigned           maxfiles   = LOGFILE_DEFMAX;
+static unsigned long long maxtime    = LOGFILE_DEFTIME;
+static size_t             maxsize    = LOGFILE_DEFSIZE;
+static size_t             maxtotal   = 0;
+static unsigned           minfiles   = 0;
+
+static int                in_fd      = STDIN_FILENO;
+static bool               timestamp  = false;
+static bool               buffered   = false;
+static bool               skip_empty = false;
+static size_t             maxline    = 0;
+static char              *continuation = LINE_CONTINUATION;
+static bool               prealloc   = false;
+static size_t             indexsize  = LOGINDEX_DEFSIZE;
+static bool               bloom      = false;
+static size_t             syncsize   = 0;
+static unsigned           syncmsec   = 0;
+static unsigned           onfull     = 0;
+static size_t             fullbuf    = FULL_BUFFER_SIZE;
+static char              *processor  = NULL;
+static unsigned           procjobs   = 1;
+static int                procnice   = 10;
+static bool               procidle   = false;
+static size_t             ringsize   = 0;
+static unsigned           uring_depth = 0;
+static struct uring      *ring       = NULL;
+static int                returncode = 0;
+static struct dbuf        line       = DBUF_INIT;
+static struct dbuf        overflow   = DBUF_INIT;
+static struct tstamp      tstamp     = TSTAMP_INIT;
+
+
+/*
+ * Rotated log files are tracked in a ring buffer sorted by age, which is
+ * filled by scanning the log directory once at startup, and then updated
+ * as files are rotated and pruned. This way rotation does not need to
+ * rescan the directory, and its cost does not depend on the number of
+ * log files kept. The sizes of the files are tracked as well, so their
+ * total is known without calling stat() on each of them.
+ */
+struct logfile {
+    unsigned long long key;
+    unsigned long long size;
+    char              *name;
+};
+
+struct logfiles {
+    struct logfile    *items;
+    size_t             alloc;
+    size_t             head;
+    size_t             count;
+    unsigned long long total;
+};
+
+
+/*
+ * Lines may be written to more than one log directory, which are given in
+ * the command line after the first one, along with selectors that decide
+ * which lines go to each of them, in the same way as multilog(8) does: each
+ * line starts selected, "+TEXT" selects it if it starts with TEXT, "-TEXT"
+ * deselects it, and "+~REGEX" and "-~REGEX" do the same if it matches an
+ * extended regular expression. Each directory receives the lines that are
+ * selected when it is reached, and has its own rotation settings.
+ */
+struct selector {
+    const char *text;
+    size_t      len;
+    regex_t     regex;
+    bool        is_regex;
+    bool        select;
+};
+
+struct logdir {
+    const char        *path;
+    int                fd;
+    int                out_fd;
+    int                next_fd;     /* Successor of "current" */
+    int                prev_fd;     /* Rotated, still open */
+    int                index_fd;    /* Time index of "current" */
+    unsigned long long index_next;  /* Offset of the next index entry */
+    struct trigrams   *trigrams;    /* Seen in "current", for --bloom */
+    unsigned           maxfiles;
+    unsigned long long maxtime;
+    size_t             maxsize;
+    size_t             maxtotal;
+    unsigned           minfiles;
+    unsigned long long curtime;
+    unsigned long long cursize;
+    unsigned long long unsynced;
+    unsigned long long prev_unsynced;
+    struct timespec    syncfirst;
+    struct logfiles    logfiles;
+    struct dbuf        held;        /* Kept while writes fail */
+    unsigned long long dropped;
+    time_t             retry;       /* Non-zero while writes fail */
+    struct selector   *selectors;   /* Applied before reaching this one */
+    size_t             n_selectors;
+};
+
+static struct logdir *logdirs   = NULL;
+static size_t         n_logdirs = 0;
+static bool           selecting = false;
+
+
+static inline struct logfile*
+logfiles_at (struct logfiles *files, size_t i)
+{
+    assert (i < files->count);
+    return &files->items[(files->head + i) % files->alloc];
+}
+
+
+static void
+logfiles_push (struct logfiles *files, unsigned long long key,
+               const char *name, unsigned long long size)
+{
+    if (files->count == files->alloc) {
+        /* Grow and unwrap the ring, so the oldest item is at index zero. */
+        const size_t alloc = files->alloc ? files->alloc * 2 : 16;
+        struct logfile *items = reallocarray(NULL, alloc, sizeof (struct logfile));
+        for (size_t i = 0; i < files->count; i++)
+            items[i] = *logfiles_at (files, i);
+        free (files->items);
+        files->items = items;
+        files->alloc = alloc;
+        files->head = 0;
+    }
+
+    struct logfile *item = &files->items[(files->head + files->count++) % files->alloc];
+    item->key = key;
+    item->size = size;
+    item->name = strdup (name);
+    files->total += size;
+}
+
+
+static void
+logfiles_pop (struct logfiles *files)
+{
+    assert (files->count > 0);
+
+    files->total -= logfiles_at (files, 0)->size;
+    free (logfiles_at (files, 0)->name);
+    files->head = (files->head + 1) % files->alloc;
+    files->count--;
+}
+
+
+static int
+logfile_compare (const void *a, const void *b)
+{
+    const struct logfile *la = a, *lb = b;
+    return (la->key > lb->key) - (la->key < lb->key);
+}
+
+
+static void
+logfiles_scan (struct logdir *ld)
+{
+    struct dirent *dirent;
+    DIR *dir;
+    int fd;
+
+    /* fdopendir() takes ownership of the descriptor, pass a copy. */
+    if ((fd = fcntl (ld->fd, F_DUPFD_CLOEXEC, 0)) < 0 ||
+        (dir = fdopendir (fd)) == NULL)
+        die ("Unable to read directory '%s': %s\n", ld->path, ERRSTR);
+
+    while ((dirent = readdir (dir)) != NULL) {
+        unsigned long long key;
+        struct stat st;
+        if (logfile_key (dirent->d_name, &key)) {
+            if (fstatat (dirfd (dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                st.st_size = 0;
+            logfiles_push (&ld->logfiles, key, dirent->d_name, st.st_size);
+        }
+    }
+    closedir (dir);
+
+    qsort (ld->logfiles.items, ld->logfiles.count, sizeof (struct logfile), logfile_compare);
+}
+
+
+static struct logfile*
+logfiles_named (struct logfiles *files, const char *name)
+{
+    /* Recently rotated files are the ones looked up most often. */
+    for (size_t i = files->count; i-- > 0;)
+        if (!strcmp (logfiles_at (files, i)->name, name))
+            return logfiles_at (files, i);
+    return NULL;
+}
+
+
+/*
+ * The time index of "current" gets an entry each time --index bytes have
+ * been written since the previous one, and it is renamed along with the
+ * log file when rotating, and removed along with it when pruning.
+ */
+static void
+open_index (struct logdir *ld, bool truncate)
+{
+    char name[NAME_MAX + 1];
+
+    if (!indexsize || !logfile_sidecar (name, sizeof (name), LOGFILE_CURRENT, LOGINDEX_SUFFIX))
+        return;
+
+    ld->index_fd = safe_openatm(ld->fd, name, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC |
+                                (truncate ? O_TRUNC : 0), LOGFILE_PERMS);
+    if (ld->index_fd < 0)
+        fprintf (stderr, "Cannot open '%s/%s': %s.\n", ld->path, name, ERRSTR);
+    ld->index_next = ld->cursize;
+}
+
+
+static void
+write_index (struct logdir *ld, const struct timespec *now, unsigned long long pending)
+{
+    const unsigned long long offset = ld->cursize + dbuf_size (&ld->held) + pending;
+    if (ld->index_fd < 0 || offset < ld->index_next)
+        return;
+
+    const struct logindex_entry entry = {
+        .time = now->tv_sec * 1000000ULL + now->tv_nsec / 1000,
+        .offset = offset,
+    };
+    struct iovec iov = iov_from_data ((void*) &entry, sizeof (entry));
+    if (writev_all(ld->index_fd, &iov, 1) < 0) {
+        /* The index is only an aid for readers, do not insist. */
+        if (errno != ENOSPC && errno != EDQUOT)
+            fprintf (stderr, "Cannot write index: %s.\n", ERRSTR);
+        return;
+    }
+    ld->index_next = offset + indexsize;
+}
+
+
+/* Renames the index of "current" after a rotated file, or removes it. */
+static void
+rotate_index (struct logdir *ld, const char *rotated)
+{
+    char name[NAME_MAX + 1], index[NAME_MAX + 1];
+
+    if (ld->index_fd < 0)
+        return;
+
+    safe_close(ld->index_fd);
+    ld->index_fd = -1;
+
+    if (!logfile_sidecar (name, sizeof (name), LOGFILE_CURRENT, LOGINDEX_SUFFIX))
+        return;
+    if (rotated && logfile_sidecar (index, sizeof (index), rotated, LOGINDEX_SUFFIX) &&
+        renameat (ld->fd, name, ld->fd, index) == 0)
+        return;
+    if (unlinkat (ld->fd, name, 0) < 0 && errno != ENOENT)
+        fprintf (stderr, "Unable to remove '%s/%s' (%s).\n", ld->path, name, ERRSTR);
+}
+
+
+/*
+ * With --bloom, the trigrams of the lines written to "current" are kept
+ * in a set, which is saved as a Bloom filter next to the file when it is
+ * rotated. The set is filled from the contents of "current" if it was
+ * not empty when drlog started.
+ */
+static void
+open_bloom (struct logdir *ld)
+{
+    if (!bloom || ld->trigrams)
+        return;
+
+    if ((ld->trigrams = calloc (1, sizeof (struct trigrams))) == NULL)
+        die ("Cannot allocate memory\n");
+
+    static uint8_t buf[64 * 1024];
+    unsigned long long offset = 0;
+    uint32_t state = 0;
+    ssize_t r;
+    while (offset < ld->cursize &&
+           (r = pread (ld->out_fd, buf, sizeof (buf), offset)) > 0) {
+        trigrams_add (ld->trigrams, buf, r, &state);
+        offset += r;
+    }
+}
+
+
+static void
+save_bloom (struct logdir *ld, const char *rotated)
+{
+    char name[NAME_MAX + 1];
+    int fd;
+
+    if (!ld->trigrams)
+        return;
+
+    if (!rotated || !logfile_sidecar (name, sizeof (name), rotated, BLOOM_SUFFIX) ||
+        (fd = safe_openatm(ld->fd, name, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                           LOGFILE_PERMS)) < 0) {
+        if (rotated)
+            fprintf (stderr, "Cannot create Bloom filter for '%s/%s': %s.\n",
+                     ld->path, rotated, ERRSTR);
+        memset (ld->trigrams, 0, sizeof (struct trigrams));
+        return;
+    }
+
+    if (!trigrams_save (ld->trigrams, fd)) {
+        /* A partial filter would hide matches, remove it. */
+        fprintf (stderr, "Cannot write Bloom filter for '%s/%s': %s.\n",
+                 ld->path, rotated, ERRSTR);
+        unlinkat (ld->fd, name, 0);
+        memset (ld->trigrams, 0, sizeof (struct trigrams));
+    }
+    safe_close(fd);
+}
+
+
+static inline void
+add_trigrams (struct logdir *ld, const void *prefix, size_t prefix_len,
+              const void *data, size_t len)
+{
+    uint32_t state = 0;
+    trigrams_add (ld->trigrams, prefix, prefix_len, &state);
+    trigrams_add (ld->trigrams, data, len, &state);
+}
+
+
+/* Removes the index and Bloom filter of a log file. */
+static void
+remove_sidecars (struct logdir *ld, const char *logname)
+{
+    static const char *suffixes[] = { LOGINDEX_SUFFIX, BLOOM_SUFFIX };
+    char name[NAME_MAX + 1];
+
+    for (size_t i = 0; i < sizeof (suffixes) / sizeof (suffixes[0]); i++)
+        if (logfile_sidecar (name, sizeof (name), logname, suffixes[i]) &&
+            unlinkat (ld->fd, name, 0) < 0 && errno != ENOENT)
+            fprintf (stderr, "Unable to remove '%s/%s' (%s).\n", ld->path, name, ERRSTR);
+}
+
+
+/*
+ * Rotated files can be handed to a --processor command (e.g. to compress
+ * or ship them). Jobs run as children of drlog, at most --processor-jobs
+ * at a time, and they are started and reaped while waiting for input, so
+ * writing never waits for them. A processor may replace the file it is
+ * given with another one whose name starts with the same one (e.g. by
+ * appending ".zst"), and the index is updated so pruning removes that
+ * instead.
+ */
+struct procjob {
+    struct logdir *dir;
+    char    *name;
+    pid_t    pid;
+    unsigned tries;
+    time_t   after;
+};
+
+static struct {
+    struct procjob *items;
+    size_t          alloc;
+    size_t          count;
+    unsigned        running;
+} procq = { NULL, 0, 0, 0 };
+
+
+static void
+processor_queue (struct logdir *ld, const char *name, unsigned tries, time_t after)
+{
+    for (size_t i = 0; i < procq.count; i++)
+        if (!procq.items[i].pid && procq.items[i].dir == ld &&
+            !strcmp (procq.items[i].name, name))
+            return;
+
+    if (procq.count == procq.alloc) {
+        procq.alloc = procq.alloc ? procq.alloc * 2 : 8;
+        procq.items = reallocarray(procq.items, procq.alloc, sizeof (struct procjob));
+    }
+    procq.items[procq.count++] = (struct procjob) {
+        .dir = ld,
+        .name = strdup (name),
+        .tries = tries,
+        .after = after,
+    };
+}
+
+
+static void
+processor_remove (size_t i, bool free_name)
+{
+    assert (i < procq.count);
+
+    if (free_name)
+        free (procq.items[i].name);
+    memmove (&procq.items[i], &procq.items[i + 1],
+             (procq.count - i - 1) * sizeof (struct procjob));
+    procq.count--;
+}
+
+
+/* Forgets about a job which has not started yet for a pruned file. */
+static void
+processor_cancel (struct logdir *ld, const char *name)
+{
+    for (size_t i = 0; i < procq.count; i++) {
+        if (!procq.items[i].pid && procq.items[i].dir == ld &&
+            !strcmp (procq.items[i].name, name)) {
+            processor_remove (i, true);
+            return;
+        }
+    }
+}
+
+
+/*
+ * Signals are not handled asynchronously: they are blocked and read from
+ * a signalfd, which wait_input() polls along with the input, so log files
+ * are only closed or rotated between batches of lines, and never while a
+ * line is being written. Without signalfd, a handler writes the signal
+ * number to a pipe which is polled instead.
+ */
+static const int handled_signals[] = { SIGHUP, SIGINT, SIGTERM, SIGUSR1 };
+static sigset_t signals_mask;   /* Mask before blocking handled signals. */
+static int signal_fd = -1;
+static int signal_pipe[2] = { -1, -1 };
+
+static void handle_signals (void);
+
+
+static pid_t
+processor_spawn (const struct procjob *job)
+{
+    sigset_t all, old;
+    pid_t pid;
+
+    /* Avoid running drlog signal handlers in the child before exec. */
+    sigfillset (&all);
+    sigprocmask (SIG_BLOCK, &all, &old);
+
+    if ((pid = fork ()) == 0) {
+        for (size_t i = 0; i < sizeof (handled_signals) / sizeof (handled_signals[0]); i++)
+            signal (handled_signals[i], SIG_DFL);
+        sigprocmask (SIG_SETMASK, &signals_mask, NULL);
+
+        int null_fd = open ("/dev/null", O_RDONLY);
+        if (null_fd < 0 || dup2 (null_fd, STDIN_FILENO) < 0 || fchdir (job->dir->fd) < 0)
+            _exit (111);
+        if (null_fd != STDIN_FILENO)
+            close (null_fd);
+        if (in_fd != STDIN_FILENO)
+            close (in_fd);
+
+        if (procnice)
+            setpriority (PRIO_PROCESS, 0, getpriority (PRIO_PROCESS, 0) + procnice);
+#ifdef SYS_ioprio_set
+        /* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE; there is no libc wrapper. */
+        if (procidle)
+            syscall (SYS_ioprio_set, 1, 0, 3 << 13);
+#endif /* SYS_ioprio_set */
+
+        execl ("/bin/sh", "sh", "-c", processor, "drlog", job->name, (char*) NULL);
+        _exit (111);
+    }
+
+    sigprocmask (SIG_SETMASK, &old, NULL);
+    return pid;
+}
+
+
+/* Returns the name of the file that a processor has replaced "name" with. */
+static char*
+processor_output (struct logdir *ld, const char *name)
+{
+    const size_t len = strlen (name);
+    struct dirent *dirent;
+    char *result = NULL;
+    DIR *dir;
+    int fd;
+
+    if ((fd = safe_openat(ld->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        (dir = fdopendir (fd)) == NULL) {
+        if (fd >= 0)
+            safe_close(fd);
+        return NULL;
+    }
+
+    while ((dirent = readdir (dir)) != NULL) {
+        if (!strncmp (dirent->d_name, name, len) && dirent->d_name[len] != '\0') {
+            result = strdup (dirent->d_name);
+            break;
+        }
+    }
+    closedir (dir);
+    return result;
+}
+
+
+static void
+processor_done (size_t i, int status)
+{
+    struct procjob job = procq.items[i];
+    struct logdir *ld = job.dir;
+    processor_remove (i, false);
+    procq.running--;
+
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+        if (!logfiles_named (&ld->logfiles, job.name)) {
+            /* Pruned while being processed, nothing left to retry. */
+        } else if (++job.tries < PROCESSOR_RETRIES) {
+            fprintf (stderr, "Processor failed for '%s/%s', retrying.\n",
+                     ld->path, job.name);
+            processor_queue (ld, job.name, job.tries,
+                             time (NULL) + PROCESSOR_RETRY_DELAY * job.tries);
+        } else {
+            fprintf (stderr, "Processor failed for '%s/%s', giving up.\n",
+                     ld->path, job.name);
+        }
+        free (job.name);
+        return;
+    }
+
+    char *output = NULL;
+    if (faccessat (ld->fd, job.name, F_OK, 0) < 0)
+        output = processor_output (ld, job.name);
+
+    struct logfile *item = logfiles_named (&ld->logfiles, job.name);
+    if (item) {
+        if (output) {
+            /* The index and filter do not apply to the new file. */
+            remove_sidecars (ld, item->name);
+            free (item->name);
+            item->name = output;
+        }
+
+        /* The processor may have changed the file size (e.g. compressing). */
+        struct stat st;
+        if (fstatat (ld->fd, item->name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            ld->logfiles.total = ld->logfiles.total - item->size + st.st_size;
+            item->size = st.st_size;
+        }
+    } else {
+        /* The file was pruned while being processed, remove the result. */
+        if (output && unlinkat (ld->fd, output, 0) < 0 && errno != ENOENT)
+            fprintf (stderr, "Unable to remove '%s/%s' (%s).\n",
+                     ld->path, output, ERRSTR);
+        free (output);
+    }
+    free (job.name);
+}
+
+
+static void
+processor_run (void)
+{
+    int status;
+    pid_t pid;
+
+    while (procq.running && (pid = waitpid (-1, &status, WNOHANG)) > 0) {
+        for (size_t i = 0; i < procq.count; i++) {
+            if (procq.items[i].pid == pid) {
+                processor_done (i, status);
+                break;
+            }
+        }
+    }
+
+    const time_t now = time (NULL);
+    for (size_t i = 0; i < procq.count && procq.running < procjobs; i++) {
+        struct procjob *job = &procq.items[i];
+        if (job->pid || job->after > now)
+            continue;
+
+        if ((job->pid = processor_spawn (job)) < 0) {
+            fprintf (stderr, "Unable to start processor: %s.\n", ERRSTR);
+            job->pid = 0;
+            break;
+        }
+        procq.running++;
+    }
+}
+
+
+/*
+ * Checks whether the oldest rotated file needs to be removed after the
+ * current one has been rotated: either there are more than --max-files,
+ * or the rotated files plus a --max-size current file would take more than
+ * --max-total bytes, as long as --min-files would be left.
+ */
+static bool
+must_prune (const struct logdir *ld)
+{
+    const struct logfiles *files = &ld->logfiles;
+
+    if (!files->count)
+        return false;
+
+    /* The newest rotated file is always kept, even with "-m 0". */
+    if (files->count > (ld->maxfiles ? ld->maxfiles : 1))
+        return true;
+
+    return ld->maxtotal && files->count > (ld->minfiles ? ld->minfiles : 1) &&
+        files->total + ld->maxsize > ld->maxtotal;
+}
+
+
+static int
+rotate_log (struct logdir *ld)
+{
+    while (must_prune (ld)) {
+        const char *name = logfiles_at (&ld->logfiles, 0)->name;
+        if (unlinkat (ld->fd, name, 0) < 0 && errno != ENOENT) {
+            fprintf (stderr, "Unable to remove '%s/%s' (%s).\n",
+                     ld->path, name, ERRSTR);
+            return -2;
+        }
+        remove_sidecars (ld, name);
+        processor_cancel (ld, name);
+        logfiles_pop (&ld->logfiles);
+    }
+    return 0;
+}
+
+
+/*
+ * With --on-full, failing writes (typically due to a full disk) do not
+ * block drlog, which would make the logged process block in turn once
+ * the pipe fills up. Instead, the oldest rotated files may be removed to
+ * make room ("prune"), the data kept in memory up to --full-buffer bytes
+ * ("buffer"), or discarded ("drop"), in that order. Writing is retried
+ * every FULL_RETRY_DELAY seconds meanwhile, and once it works again the
+ * kept data is written, followed by a line noting how many were dropped.
+ */
+#define FULL_PRUNE  (1 << 0)
+#define FULL_BUFFER (1 << 1)
+#define FULL_DROP   (1 << 2)
+
+
+static enum cflag_status
+onfull_option (const struct cflag *spec, const char *arg)
+{
+    if (!spec)
+        return CFLAG_NEEDS_ARG;
+
+    static const struct {
+        const char *name;
+        unsigned    policy;
+    } policies[] = {
+        { "block",  0           },
+        { "prune",  FULL_PRUNE  },
+        { "buffer", FULL_BUFFER },
+        { "drop",   FULL_DROP   },
+    };
+
+    unsigned result = 0;
+    while (*arg) {
+        const size_t len = strcspn (arg, ",");
+        unsigned i = 0;
+        while (i < sizeof (policies) / sizeof (policies[0]) &&
+               (strlen (policies[i].name) != len || strncmp (arg, policies[i].name, len)))
+            i++;
+        if (i == sizeof (policies) / sizeof (policies[0]))
+            return CFLAG_BAD_FORMAT;
+
+        result |= policies[i].policy;
+        arg += len + (arg[len] == ',');
+    }
+
+    *((unsigned*) spec->data) = result;
+    return CFLAG_OK;
+}
+
+
+static bool
+prune_oldest (struct logdir *ld)
+{
+    if (!ld->logfiles.count)
+        return false;
+
+    const char *name = logfiles_at (&ld->logfiles, 0)->name;
+    if (unlinkat (ld->fd, name, 0) < 0 && errno != ENOENT)
+        return false;
+
+    fprintf (stderr, "Removed '%s/%s' to make room.\n", ld->path, name);
+    remove_sidecars (ld, name);
+    processor_cancel (ld, name);
+    logfiles_pop (&ld->logfiles);
+    return true;
+}
+
+
+static inline int
+min_timeout (int a, int b)
+{
+    return (a < 0 || (b >= 0 && b < a)) ? b : a;
+}
+
+
+/*
+ * Group commit: instead of syncing after each write, written data is
+ * synced once --sync-size bytes have accumulated or --sync-interval
+ * milliseconds have passed since the first unsynced write, whichever
+ * comes first. Without either option, every write is synced. Accounts
+ * for "bytes" more written, and returns whether they need syncing now.
+ */
+static bool
+sync_due (struct logdir *ld, size_t bytes)
+{
+    if (buffered)
+        return false;
+
+    if (!ld->unsynced)
+        clock_gettime (CLOCK_MONOTONIC, &ld->syncfirst);
+    ld->unsynced += bytes;
+
+    return (!syncsize && !syncmsec) ||
+        (syncsize && ld->unsynced >= syncsize) ||
+        (syncmsec && msec_since (&ld->syncfirst) >= syncmsec);
+}
+
+
+/*
+ * With --io-uring, lines are copied into batches which the kernel writes
+ * in the background, so input keeps being read while the disk catches up.
+ * The log file is not opened in append mode then: each batch is written
+ * at the offset reserved for it when submitted, and short writes resume
+ * where they stopped. When data needs to be synced, a fdatasync is linked
+ * after the write, and the write waits for previously submitted ones to
+ * complete, so the sync covers them as well. Failed writes are retried
+ * after a while, like in the blocking code path.
+ */
+struct batch {
+    char     *data;
+    size_t    size;
+    size_t    alloc;
+    size_t    done;
+    off_t     offset;
+    time_t    retry;
+    unsigned  pending;
+    int       fd;
+    struct logdir *dir;
+    bool      sync;
+    bool      busy;
+};
+
+static struct batch *batches  = NULL;
+static unsigned      inflight = 0; /* Submitted batches */
+static unsigned      inflight_syncs = 0;
+
+/* Completion data: batch index plus one, and whether it is a sync. */
+#define BATCH_DATA(_index, _sync) ((((uint64_t) (_index) + 1) << 1) | (_sync))
+
+
+static void
+batch_add (struct batch *b, const void *data, size_t size)
+{
+    if (b->size + size > b->alloc) {
+        b->alloc = b->alloc ? b->alloc * 2 : 4096;
+        if (b->alloc < b->size + size)
+            b->alloc = b->size + size;
+        if ((b->data = realloc (b->data, b->alloc)) == NULL)
+            die ("Cannot allocate memory\n");
+    }
+    memcpy (b->data + b->size, data, size);
+    b->size += size;
+}
+
+
+static void
+batch_queue (struct batch *b)
+{
+    const unsigned index = b - batches;
+
+    /* There is always room for two entries per batch. */
+    if (!uring_write (ring, b->fd, b->data + b->done, b->size - b->done,
+                      b->offset + b->done, BATCH_DATA (index, 0), b->sync, b->sync) ||
+        (b->sync && !uring_fdatasync (ring, b->fd, BATCH_DATA (index, 1), false)))
+        die ("Internal inconsistency at %s:%i\n", __FILE__, __LINE__);
+
+    b->pending = 1 + b->sync;
+    if (uring_submit (ring) < 0)
+        fprintf (stderr, "Cannot submit writes: %s.\n", ERRSTR);
+}
+
+
+static void
+batch_submit (struct logdir *ld, struct batch *b)
+{
+    b->busy = false;
+    if (!b->size)
+        return;
+
+    b->busy = true;
+    b->done = 0;
+    b->fd = ld->out_fd;
+    b->dir = ld;
+    b->offset = ld->cursize;
+    ld->cursize += b->size;
+
+    if ((b->sync = sync_due (ld, b->size)))
+        ld->unsynced = 0;
+
+    inflight++;
+    batch_queue (b);
+}
+
+
+static void
+batch_complete (uint64_t data, int res)
+{
+    if (!(data >> 1)) {
+        inflight_syncs--;
+        if (res < 0)
+            fprintf (stderr, "Cannot sync logfile: %s.\n", strerror (-res));
+        return;
+    }
+
+    struct batch *b = &batches[(data >> 1) - 1];
+    b->pending--;
+
+    if (data & 1) {
+        /* Syncs are cancelled after short writes, they are resubmitted. */
+        if (res < 0 && res != -ECANCELED)
+            fprintf (stderr, "Cannot sync logfile: %s.\n", strerror (-res));
+    } else if (res > 0) {
+        b->done += res;
+    } else if ((res == -ENOSPC || res == -EDQUOT) &&
+               (onfull & FULL_PRUNE) && prune_oldest (b->dir)) {
+        /* Resubmitted right away below. */
+    } else {
+        fprintf (stderr, "Cannot write to logfile: %s.\n", strerror (res ? -res : EIO));
+        b->retry = time (NULL) + URING_RETRY_DELAY;
+    }
+
+    if (b->pending)
+        return;
+
+    if (b->done == b->size) {
+        b->size = 0;
+        b->busy = false;
+        inflight--;
+    } else if (!b->retry) {
+        batch_queue (b);
+    }
+}
+
+
+static void
+batch_reap (void)
+{
+    uint64_t data;
+    int res;
+
+    while (uring_reap (ring, &data, &res))
+        batch_complete (data, res);
+}
+
+
+/*
+ * Resubmits failed batches whose retry delay has passed, and returns the
+ * milliseconds until the next one needs to be retried.
+ */
+static int
+batch_retry_timeout (void)
+{
+    const time_t now = time (NULL);
+    int timeout = -1;
+
+    for (unsigned i = 0; i < uring_depth; i++) {
+        struct batch *b = &batches[i];
+        if (!b->retry || b->pending)
+            continue;
+
+        if (b->retry <= now) {
+            b->retry = 0;
+            batch_queue (b);
+        } else {
+            timeout = min_timeout (timeout, (b->retry - now) * 1000);
+        }
+    }
+    return timeout;
+}
+
+
+/* Waits for some batch to complete, or to be retried. */
+static void
+batch_wait (void)
+{
+    const int timeout = batch_retry_timeout ();
+
+    /* Submits leftovers, in case a previous submission failed. */
+    uring_submit (ring);
+
+    struct pollfd pfd = { .fd = uring_fd (ring), .events = POLLIN };
+    if (poll (&pfd, 1, timeout) < 0 && errno != EINTR)
+        die ("Cannot wait for writes to complete: %s\n", ERRSTR);
+    batch_reap ();
+}
+
+
+static struct batch*
+batch_get (void)
+{
+    for (;;) {
+        batch_reap ();
+        for (unsigned i = 0; i < uring_depth; i++)
+            if (!batches[i].busy)
+                return &batches[i];
+        batch_wait ();
+    }
+}
+
+
+/* Whether writes to a log directory have been submitted and not done. */
+static bool
+batch_pending (const struct logdir *ld)
+{
+    for (unsigned i = 0; i < uring_depth; i++)
+        if (batches[i].busy && batches[i].dir == ld)
+            return true;
+    return false;
+}
+
+
+static void
+batch_drain (void)
+{
+    while (inflight || inflight_syncs)
+        batch_wait ();
+}
+
+
+static void
+sync_log (struct logdir *ld)
+{
+    if (!ld->unsynced)
+        return;
+
+    if (ring && uring_fdatasync (ring, ld->out_fd, 0, true)) {
+        /* Runs after the writes submitted so far have completed. */
+        inflight_syncs++;
+        if (uring_submit (ring) < 0)
+            fprintf (stderr, "Cannot submit writes: %s.\n", ERRSTR);
+    } else {
+        if (ring)
+            batch_drain ();
+        if (safe_fdatasync (ld->out_fd) != 0)
+            fprintf (stderr, "Cannot sync logfile: %s.\n", ERRSTR);
+    }
+    ld->unsynced = 0;
+}
+
+
+static void
+sync_written (struct logdir *ld, size_t bytes)
+{
+    if (sync_due (ld, bytes))
+        sync_log (ld);
+}
+
+
+/*
+ * With --ring-size, input is read by a separate thread into a ring buffer
+ * of that size, and the main thread takes data from it to split lines,
+ * write, sync, and rotate files. A slow disk then fills the ring instead
+ * of the pipe from the logged process, which keeps running until the ring
+ * is full. The reader reads directly into the free part of the ring; both
+ * threads use a pipe to wake up the other when they wait for data or for
+ * free space. The main thread polls the data pipe along with any timers.
+ * Sending SIGUSR1 prints how much of the ring is used.
+ */
+static struct {
+    uint8_t         *data;
+    size_t           size;
+    _Atomic size_t   head;       /* Total bytes added by the reader. */
+    _Atomic size_t   tail;       /* Total bytes taken by the main thread. */
+    _Atomic size_t   peak;
+    _Atomic int      error;
+    _Atomic bool     eof;
+    _Atomic bool     reader_waiting;
+    _Atomic bool     writer_waiting;
+    int              data_fds[2];
+    int              space_fds[2];
+    pthread_t        thread;
+} input = { .data = NULL, .data_fds = { -1, -1 }, .space_fds = { -1, -1 } };
+
+static void
+input_wake (int fd, _Atomic bool *waiting)
+{
+    /* Extra bytes only cause spurious wakeups, which are harmless. */
+    if (atomic_exchange (waiting, false)) {
+        const char c = 0;
+        if (write (fd, &c, 1) < 0 && errno != EAGAIN)
+            fprintf (stderr, "Cannot wake up thread: %s.\n", ERRSTR);
+    }
+}
+
+
+static void
+input_clear_wakeups (int fd)
+{
+    char buf[64];
+    while (read (fd, buf, sizeof (buf)) > 0)
+        ;
+}
+
+
+static void*
+input_reader (void *arg)
+{
+    (void) arg;
+
+    for (;;) {
+        const size_t head = atomic_load (&input.head);
+        const size_t used = head - atomic_load (&input.tail);
+
+        if (used == input.size) {
+            atomic_store (&input.reader_waiting, true);
+            if (head - atomic_load (&input.tail) == input.size) {
+                struct pollfd pfd = { .fd = input.space_fds[0], .events = POLLIN };
+                poll (&pfd, 1, -1);
+                input_clear_wakeups (input.space_fds[0]);
+            }
+            continue;
+        }
+
+        const size_t offset = head % input.size;
+        size_t room = input.size - used;
+        if (room > input.size - offset)
+            room = input.size - offset;
+
+        ssize_t r = safe_read (in_fd, input.data + offset, room);
+        if (r <= 0) {
+            atomic_store (&input.error, r < 0 ? errno : 0);
+            atomic_store (&input.eof, true);
+            input_wake (input.data_fds[1], &input.writer_waiting);
+            return NULL;
+        }
+
+        atomic_store (&input.head, head + r);
+        if (used + r > atomic_load (&input.peak))
+            atomic_store (&input.peak, used + r);
+        input_wake (input.data_fds[1], &input.writer_waiting);
+    }
+}
+
+
+static void
+input_start (void)
+{
+    sigset_t all, old;
+
+    if ((input.data = malloc (ringsize)) == NULL)
+        die ("Cannot allocate memory\n");
+    input.size = ringsize;
+
+    if (pipe2 (input.data_fds, O_CLOEXEC | O_NONBLOCK) < 0 ||
+        pipe2 (input.space_fds, O_CLOEXEC | O_NONBLOCK) < 0)
+        die ("Cannot create pipe: %s\n", ERRSTR);
+
+    /* Signals are handled by the main thread. */
+    sigfillset (&all);
+    pthread_sigmask (SIG_BLOCK, &all, &old);
+    int err = pthread_create (&input.thread, NULL, input_reader, NULL);
+    pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+    if (err)
+        die ("Cannot create thread: %s\n", strerror (err));
+}
+
+
+/* Moves all the data available in the ring to the buffer. */
+static size_t
+input_take (struct dbuf *buffer)
+{
+    const size_t tail = atomic_load (&input.tail);
+    const size_t used = atomic_load (&input.head) - tail;
+    const size_t offset = tail % input.size;
+
+    if (!used)
+        return 0;
+
+    if (offset + used > input.size) {
+        buffer_append (buffer, input.data + offset, input.size - offset);
+        buffer_append (buffer, input.data, used - (input.size - offset));
+    } else {
+        buffer_append (buffer, input.data + offset, used);
+    }
+
+    atomic_store (&input.tail, tail + used);
+    input_wake (input.space_fds[1], &input.reader_waiting);
+    return used;
+}
+
+
+static void
+input_stats (void)
+{
+    const size_t used = atomic_load (&input.head) - atomic_load (&input.tail);
+    fprintf (stderr, "Input ring: %zu/%zu bytes used (%u%%), peak %zu bytes.\n",
+             used, input.size, (unsigned) (used * 100 / input.size),
+             atomic_load (&input.peak));
+}
+
+
+/*
+ * Returns the descriptor to poll for input, or -1 if there is input
+ * available already (or end of file) in the ring.
+ */
+static int
+input_poll_fd (void)
+{
+    if (!input.data)
+        return in_fd;
+
+    atomic_store (&input.writer_waiting, true);
+    if (atomic_load (&input.eof) ||
+        atomic_load (&input.head) != atomic_load (&input.tail))
+        return -1;
+    return input.data_fds[0];
+}
+
+
+/*
+ * Equivalent of read(), appending the data to the buffer: reads once from
+ * the input, or takes data from the ring. Lines are not waited for to be
+ * complete, so signals are not delayed by a partial line.
+ */
+static ssize_t
+input_read (struct dbuf *buffer)
+{
+    if (!input.data) {
+        const size_t size = dbuf_size (buffer);
+        buffer_reserve (buffer, INPUT_READ_SIZE);
+        const ssize_t r = safe_read (in_fd, dbuf_data (buffer) + size, INPUT_READ_SIZE);
+        buffer->size = size + (r > 0 ? r : 0);
+        return r;
+    }
+
+    for (;;) {
+        const bool eof = atomic_load (&input.eof);
+        size_t bytes = input_take (buffer);
+        if (bytes)
+            return bytes;
+
+        if (eof) {
+            if (!(errno = atomic_load (&input.error)))
+                return 0;
+            return -1;
+        }
+
+        int fd = input_poll_fd ();
+        if (fd >= 0) {
+            struct pollfd pfd[2] = {
+                { .fd = fd, .events = POLLIN },
+                { .fd = signal_fd, .events = POLLIN },
+            };
+            poll (pfd, 2, -1);
+            input_clear_wakeups (fd);
+            if (pfd[1].revents)
+                handle_signals ();
+        }
+    }
+}
+
+
+/*
+ * With --preallocate, disk space for the whole --max-size of the current
+ * log file is reserved up front, without changing its apparent size. This
+ * way appends do not need to allocate blocks (which fragments files when
+ * there are many writers, and adds metadata updates to each sync), and the
+ * unused tail is released when the file is closed.
+ */
+static void
+preallocate_log (const struct logdir *ld, int fd, unsigned long long size)
+{
+    if (!prealloc || !ld->maxsize || size >= ld->maxsize)
+        return;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (fallocate (fd, FALLOC_FL_KEEP_SIZE, 0, ld->maxsize) == 0)
+        return;
+    fprintf (stderr, "Cannot preallocate logfile, disabling: %s.\n", ERRSTR);
+#else
+    fprintf (stderr, "Preallocation is not supported, disabling.\n");
+#endif /* FALLOC_FL_KEEP_SIZE */
+    prealloc = false;
+}
+
+
+static void
+trim_log (int fd)
+{
+    struct stat st;
+
+    if (!prealloc)
+        return;
+
+    /* Truncating to the same size frees the blocks past the end. */
+    if (fstat (fd, &st) < 0 || ftruncate (fd, st.st_size) < 0)
+        fprintf (stderr, "Cannot trim preallocated logfile: %s.\n", ERRSTR);
+}
+
+
+/*
+ * The start time of the current log file is kept in an extended attribute
+ * of the file itself, which avoids keeping a separate file in sync with it.
+ * When the attribute is missing or not supported, the creation time of the
+ * file is used, and if that is not available either, the current time.
+ */
+static bool xattr_ok = true;
+
+
+static bool
+read_epoch_legacy (const struct logdir *ld, time_t *epoch)
+{
+    unsigned long long ts;
+    FILE *ts_file;
+    int ts_fd;
+
+    if ((ts_fd = safe_openat(ld->fd, LOGDIR_TSTAMP, O_RDONLY | O_CLOEXEC)) < 0)
+        return false;
+
+    if ((ts_file = safe_fdopen(ts_fd, "r")) == NULL) {
+        safe_close(ts_fd);
+        return false;
+    }
+
+    const bool ok = fscanf (ts_file, "%llu", &ts) == 1 && !ferror (ts_file);
+    fclose (ts_file);
+
+    if (ok)
+        *epoch = ts;
+    return ok;
+}
+
+
+static void
+write_epoch (int fd, time_t epoch)
+{
+    char buf[24];
+
+    if (!xattr_ok)
+        return;
+
+    const int len = snprintf (buf, sizeof (buf), "%llu", (unsigned long long) epoch);
+    if (fsetxattr (fd, LOGFILE_XATTR, buf, len, 0) == 0)
+        return;
+
+    fprintf (stderr, "Cannot store logfile time, using its creation time: %s.\n", ERRSTR);
+    xattr_ok = false;
+}
+
 
-#ifndef LOGDIR_TSTAMP
-#define LOGDIR_TSTAMP ".timestamp"
-#endif /* !LOGDIR_TSTAMP */
+static time_t
+read_epoch (const struct logdir *ld, int fd)
+{
+    char buf[24];
+    ssize_t len;
+    time_t ts;
+
+    if (xattr_ok && (len = fgetxattr (fd, LOGFILE_XATTR, buf, sizeof (buf) - 1)) > 0) {
+        char *end;
+        buf[len] = '\0';
+        errno = 0;
+        ts = strtoull (buf, &end, 10);
+        if (errno == 0 && *end == '\0')
+            return ts;
+    }
 
-#ifndef LOGFILE_PERMS
-#define LOGFILE_PERMS 0640
-#endif /* !LOGFILE_PERMS */
+    /* Migrate the start time saved by older versions. */
+    if (read_epoch_legacy (ld, &ts)) {
+        write_epoch (fd, ts);
+        unlinkat (ld->fd, LOGDIR_TSTAMP, 0);
+        return ts;
+    }
 
-#ifndef LOGFILE_PREFIX
-#define LOGFILE_PREFIX "log-"
-#endif /* !LOGFILE_PREFIX */
+#ifdef STATX_BTIME
+    struct statx stx;
+    if (statx (fd, "", AT_EMPTY_PATH, STATX_BTIME, &stx) == 0 && (stx.stx_mask & STATX_BTIME))
+        ts = stx.stx_btime.tv_sec;
+    else
+#endif /* STATX_BTIME */
+        ts = time (NULL);
 
-#ifndef LOGFILE_CURRENT
-#define LOGFILE_CURRENT "current"
-#endif /* !LOGFILE_CURRENT */
+    write_epoch (fd, ts);
+    return ts;
+}
 
-#ifndef LOGFILE_DEFMAX
-#define LOGFILE_DEFMAX 10
-#endif /* !LOGFILE_DEFMAX */
 
-#ifndef LOGFILE_DEFSIZE
-#define LOGFILE_DEFSIZE (150 * 1024) /* 150 kB */
-#endif /* !LOGFILE_DEFSIZE */
+static inline int
+open_flags (void)
+{
+    /* With io_uring writes go to the offsets reserved for them. */
+    return O_CREAT | O_WRONLY | O_CLOEXEC | (ring ? 0 : O_APPEND);
+}
 
-#ifndef LOGFILE_DEFTIME
-#define LOGFILE_DEFTIME (60 * 60 * 24 * 5) /* Five days */
-#endif /* !LOGFILE_DEFTIME */
 
-#ifndef TSTAMP_FMT
-#define TSTAMP_FMT "%Y-%m-%d/%H:%M:%S "
-#endif /* !TSTAMP_FMT */
+static void
+set_epoch (struct logdir *ld, time_t epoch)
+{
+    ld->curtime = epoch;
+    if (ld->maxtime) {
+        ld->curtime -= (ld->curtime % ld->maxtime);
+    }
+}
+
+
+/*
+ * The file which replaces "current" on rotation is created in advance
+ * as a hidden file, so rotating needs only renaming files and switching
+ * to the new descriptor. Syncing and closing the rotated file, pruning
+ * old files, and creating the next hidden file, are left for later, in
+ * finish_rotate(), once the lines being written have been handled.
+ */
+static void
+open_next (struct logdir *ld)
+{
+    if (ld->next_fd >= 0)
+        return;
+
+    if ((ld->next_fd = safe_openatm(ld->fd, LOGFILE_NEXT, open_flags () | O_TRUNC, LOGFILE_PERMS)) < 0) {
+        fprintf (stderr, "Cannot create '%s/" LOGFILE_NEXT "': %s.\n", ld->path, ERRSTR);
+        return;
+    }
+    preallocate_log (ld, ld->next_fd, 0);
+}
 
-#ifndef TSTAMP_LEN
-#define TSTAMP_LEN (5 + 3 + 3 + 3 + 3 + 3)
-#endif /* !TSTAMP_LEN */
 
+static void
+open_log (struct logdir *ld)
+{
+    if ((ld->out_fd = safe_openatm(ld->fd, LOGFILE_CURRENT, open_flags (), LOGFILE_PERMS)) < 0)
+        die ("Cannot open '%s/" LOGFILE_CURRENT "': %s\n", ld->path, ERRSTR);
+
+    set_epoch (ld, read_epoch (ld, ld->out_fd));
+    ld->cursize = (unsigned long long) lseek (ld->out_fd, 0, SEEK_END);
+    preallocate_log (ld, ld->out_fd, ld->cursize);
+    open_index (ld, ld->cursize == 0);
+    open_bloom (ld);
+    open_next (ld);
+}
+
+
+static void
+finish_rotate (struct logdir *ld)
+{
+    if (ld->prev_fd < 0)
+        return;
+
+    if (ring)
+        batch_drain ();
+    if (ld->prev_unsynced && safe_fdatasync (ld->prev_fd) != 0)
+        fprintf (stderr, "Cannot sync logfile: %s.\n", ERRSTR);
+    trim_log (ld->prev_fd);
+
+    /* TODO: Warn on close errors. */
+    safe_close(ld->prev_fd);
+    ld->prev_fd = -1;
+    ld->prev_unsynced = 0;
+
+    rotate_log (ld);
+    write_epoch (ld->out_fd, ld->curtime);
+}
+
+
+/* Files are only rotated when both --max-size and --max-time are set. */
+static inline bool
+rotation_enabled (const struct logdir *ld)
+{
+    return ld->maxsize && ld->maxtime;
+}
 
-static char              *directory  = NULL;
-static int                out_fd     = -1;
-static int                in_fd      = -1;
-static unsigned           maxfiles   = LOGFILE_DEFMAX;
-static unsigned long long maxtime    = LOGFILE_DEFTIME;
-static size_t             maxsize    = LOGFILE_DEFSIZE;
-static unsigned long long curtime    = 0;
-static unsigned long long cursize    = 0;
-static bool               timestamp  = false;
-static bool               buffered   = false;
-static bool               skip_empty = false;
-static int                returncode = 0;
-static struct dbuf        line       = DBUF_INIT;
-static struct dbuf        overflow   = DBUF_INIT;
 
+static void
+check_rotate (struct logdir *ld, time_t now)
+{
+    if (!rotation_enabled (ld))
+        return;
+
+    if (ld->cursize < ld->maxsize && (unsigned long long) now <= (ld->curtime + ld->maxtime))
+        return;
+
+    if (!ld->cursize) {
+        /* Do not rotate empty files, start their time period over instead. */
+        ld->curtime = now - (now % ld->maxtime);
+        return;
+    }
+
+    struct logfiles *files = &ld->logfiles;
+    char newname[NAME_MAX + 1];
+    struct timespec ts;
+
+    if (ld->out_fd < 0) {
+        die ("Internal inconsistency at %s:%i\n", __FILE__, __LINE__);
+        assert (!"unreachable");
+    }
+
+    finish_rotate (ld);
+    open_next (ld);
+
+    /*
+     * Readers (drtail, --processor) take a rotated file as complete, so
+     * the writes queued for it must be done before it gets renamed.
+     */
+    if (ring)
+        while (batch_pending (ld))
+            batch_wait ();
+
+    /*
+     * Names are unique even with many rotations per second, or if the
+     * clock goes backwards: each one is newer than the previous one.
+     */
+    clock_gettime (CLOCK_REALTIME, &ts);
+    unsigned long long key = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    if (files->count && key <= logfiles_at (files, files->count - 1)->key)
+        key = logfiles_at (files, files->count - 1)->key + 1;
+
+    int r;
+    for (;;) {
+        logfile_name (newname, sizeof (newname), key);
+#ifdef RENAME_NOREPLACE
+        r = renameat2 (ld->fd, LOGFILE_CURRENT, ld->fd, newname, RENAME_NOREPLACE);
+        if (r < 0 && errno == EEXIST) {
+            key++;
+            continue;
+        }
+        if (r == 0 || (errno != EINVAL && errno != ENOSYS))
+            break;
+#endif /* RENAME_NOREPLACE */
+        r = renameat (ld->fd, LOGFILE_CURRENT, ld->fd, newname);
+        break;
+    }
 
+    if (r < 0) {
+        if (unlinkat (ld->fd, LOGFILE_CURRENT, 0) < 0)
+            die ("Unable to rename '%s/" LOGFILE_CURRENT "' to '%s/%s'\n",
+                 ld->path, ld->path, newname);
+    } else {
+        logfiles_push (files, key, newname, ld->cursize);
+        if (processor)
+            processor_queue (ld, newname, 0, 0);
+    }
+    rotate_index (ld, r < 0 ? NULL : newname);
+    save_bloom (ld, r < 0 ? NULL : newname);
+
+    if (ld->next_fd >= 0 && renameat (ld->fd, LOGFILE_NEXT, ld->fd, LOGFILE_CURRENT) == 0) {
+        ld->prev_fd = ld->out_fd;
+        ld->prev_unsynced = ld->unsynced;
+        ld->out_fd = ld->next_fd;
+        ld->next_fd = -1;
+        ld->unsynced = 0;
+        ld->cursize = 0;
+        set_epoch (ld, now);
+        open_index (ld, true);
+        return;
+    }
+
+    /* Fall back to reopening the log file. */
+    sync_log (ld);
+    if (ring)
+        batch_drain ();
+    trim_log (ld->out_fd);
+
+    /* TODO: Warn on close errors. */
+    safe_close(ld->out_fd);
+    ld->out_fd = -1;
+
+    if (ld->next_fd >= 0) {
+        safe_close(ld->next_fd);
+        ld->next_fd = -1;
+    }
+
+    rotate_log (ld);
+    open_log (ld);
+}
+
+
+/*
+ * Returns the milliseconds until the current log file needs to be rotated
+ * because of its age, rotating it right away if that time has passed.
+ */
 static int
-rotate_log (void)
+rotate_timeout (struct logdir *ld)
 {
-    char old_name[MAXPATHLEN];
-    char path[MAXPATHLEN];
-    const char *name;
-    DIR *dir;
-    struct dirent *dirent;
-    unsigned foundlogs;
-    int year, mon, mday, hour, min, sec;
-    int older_year, older_mon = INT_MAX, older_mday = INT_MAX,
-            older_hour = INT_MAX, older_min = INT_MAX, older_sec = INT_MAX;
-
-rescan:
-    foundlogs = 0;
-    *old_name = 0;
-    older_year = INT_MAX;
-
-    if ((dir = opendir (directory)) == NULL) {
-        fprintf (stderr, "Unable to open directory '%s' for rotation (%s).\n",
-                 directory, ERRSTR);
+    if (ld->out_fd < 0 || !ld->cursize || !ld->maxsize || !ld->maxtime)
+        return -1;
+
+    const time_t now = time (NULL);
+    if ((unsigned long long) now > ld->curtime + ld->maxtime) {
+        check_rotate (ld, now);
         return -1;
     }
 
-    while ((dirent = readdir (dir)) != NULL) {
-        name = dirent->d_name;
-        if (!strncmp (name, LOGFILE_PREFIX, sizeof (LOGFILE_PREFIX) - 1U)) {
-            if (sscanf (name, LOGFILE_PREFIX "%d-%d-%d-%d:%d:%d",
-                        &year, &mon, &mday, &hour, &min, &sec) != 6)
-                continue;
+    /* Rotation happens once the deadline second has fully passed. */
+    const unsigned long long left = ld->curtime + ld->maxtime + 1 - now;
+    return (left > ROTATE_MAX_WAIT) ? ROTATE_MAX_WAIT * 1000 : (int) left * 1000;
+}
 
-            foundlogs++;
-            if (year < older_year || (year == older_year &&
-               (mon  < older_mon  || (mon  == older_mon  &&
-               (mday < older_mday || (mday == older_mday &&
-               (hour < older_hour || (hour == older_hour &&
-               (min  < older_min  || (min  == older_min  &&
-               (sec  < older_sec))))))))))) /* Oh yeah! */
-            {
-                older_year = year;
-                older_mon  = mon ;
-                older_mday = mday;
-                older_hour = hour;
-                older_min  = min ;
-                older_sec  = sec ;
-                strncpy (old_name, name, sizeof (old_name));
-                old_name[sizeof (old_name) - 1] = 0;
-            }
+
+static size_t
+iov_size (const struct iovec *iov, int n_iov)
+{
+    size_t size = 0;
+    for (int i = 0; i < n_iov; i++)
+        size += iov[i].iov_len;
+    return size;
+}
+
+
+/*
+ * Writes all the data, removing rotated files when the disk is full if
+ * allowed by --on-full. On failure "iov" is left pointing at the data
+ * which has not been written.
+ */
+static bool
+write_iov (struct logdir *ld, struct iovec *iov, int n_iov)
+{
+    while (iov_size (iov, n_iov)) {
+        ssize_t r = writev_all(ld->out_fd, iov, n_iov);
+        if (r > 0) {
+            ld->cursize += r;
+            sync_written (ld, r);
+            continue;
         }
+
+        if ((errno == ENOSPC || errno == EDQUOT) &&
+            (onfull & FULL_PRUNE) && prune_oldest (ld))
+            continue;
+        return false;
     }
+    return true;
+}
 
-    closedir (dir);
 
-    if (foundlogs >= maxfiles) {
-        if (*old_name == 0) {
-            return -3;
-        }
-        if (snprintf (path, sizeof (path), "%s/%s", directory, old_name) < 0) {
-            fprintf (stderr, "Path too long to unlink: %s/%s\n", directory, old_name);
-            return -4;
+/* Keeps or drops data which cannot be written, if --on-full allows it. */
+static bool
+hold_data (struct logdir *ld, const struct iovec *iov, int n_iov)
+{
+    const size_t size = iov_size (iov, n_iov);
+
+    if ((onfull & FULL_BUFFER) && dbuf_size (&ld->held) + size <= fullbuf) {
+        for (int i = 0; i < n_iov; i++)
+            if (iov[i].iov_len)
+                dbuf_addmem (&ld->held, iov[i].iov_base, iov[i].iov_len);
+        return true;
+    }
+
+    if (onfull & FULL_DROP) {
+        /* The first line may have been written partially, keep the rest. */
+        bool keep = dbuf_empty (&ld->held);
+        for (int i = 0; i < n_iov; i++) {
+            const char *p = iov[i].iov_base, *end = p + iov[i].iov_len;
+            while (p < end) {
+                const char *nl = memchr (p, '\n', end - p);
+                if (keep) {
+                    const size_t len = nl ? (size_t) (nl - p + 1) : (size_t) (end - p);
+                    dbuf_addmem (&ld->held, p, len);
+                    keep = !nl;
+                    p += len;
+                } else if (nl) {
+                    ld->dropped++;
+                    p = nl + 1;
+                } else {
+                    break;
+                }
+            }
         }
-        if (unlink (path) < 0) {
-            return -2;
+        return true;
+    }
+
+    return false;
+}
+
+
+/*
+ * Writes the data kept while writes were failing, followed by a line with
+ * the amount of lines dropped. Returns whether writing works again.
+ */
+static bool
+write_held (struct logdir *ld)
+{
+    if (!dbuf_empty (&ld->held)) {
+        struct iovec iov = iov_from_data (dbuf_data (&ld->held), dbuf_size (&ld->held));
+        const bool ok = write_iov (ld, &iov, 1);
+
+        const size_t written = dbuf_size (&ld->held) - iov.iov_len;
+        memmove (dbuf_data (&ld->held), dbuf_data (&ld->held) + written, iov.iov_len);
+        ld->held.size = iov.iov_len;
+
+        if (!ok) {
+            ld->retry = time (NULL) + FULL_RETRY_DELAY;
+            return false;
         }
-        foundlogs--;
-        if (foundlogs >= maxfiles) {
-            goto rescan;
+    }
+
+    if (ld->dropped) {
+        char mark[64];
+        const int len = snprintf (mark, sizeof (mark), "drlog: %llu lines dropped\n", ld->dropped);
+        struct iovec iov[2] = {
+            iov_from_data (tstamp.buf, timestamp ? tstamp.len : 0),
+            iov_from_data (mark, len),
+        };
+        if (!write_iov (ld, iov, 2)) {
+            /* Either all or nothing, avoid leaving a partial line. */
+            ld->retry = time (NULL) + FULL_RETRY_DELAY;
+            return false;
         }
+        if (ld->trigrams)
+            add_trigrams (ld, tstamp.buf, timestamp ? tstamp.len : 0, mark, len);
+        ld->dropped = 0;
     }
-    return 0;
+
+    fprintf (stderr, "Writing to '%s' resumed.\n", ld->path);
+    dbuf_clear (&ld->held);
+    ld->retry = 0;
+    return true;
 }
 
 
+/*
+ * Waits for input to be available, handling signals and timed work
+ * meanwhile: rotating log files once they reach --max-time, syncing
+ * unsynced data when the --sync-interval deadline expires, starting and
+ * reaping --processor jobs, and completing --io-uring writes.
+ */
 static void
-flush_line (void)
+wait_input (void)
 {
-    time_t now = time (NULL);
-
-    if (out_fd < 0) {
-        /* We need to open the output file. */
-        char path[MAXPATHLEN];
-        struct stat st;
-        time_t ts;
-        FILE *ts_file;
-
-testdir:
-        if (stat (directory, &st) < 0 || !S_ISDIR (st.st_mode))
-            die ((errno == ENOENT)
-                     ? "Output directory does not exist: %s\n"
-                     : "Output path is not a directory: %s\n",
-                  directory);
-
-        if (snprintf (path, sizeof (path), "%s/" LOGFILE_CURRENT, directory) < 0)
-            die ("Path name too long: %s\n", directory);
-
-        if ((out_fd = safe_openatm(AT_FDCWD, path, O_APPEND | O_CREAT | O_WRONLY, LOGFILE_PERMS)) < 0)
-            die ("Cannot open '%s': %s\n", path, ERRSTR);
-
-        if (snprintf (path, sizeof (path), "%s/" LOGDIR_TSTAMP, directory) < 0) {
-			/* TODO: Warn on close failures. */
-            safe_close(out_fd);
-            die ("Path name too long: %s\n", directory);
-        }
-
-        if ((ts_file = fopen (path, "r")) == NULL) {
-            int ts_fd;
-recreate_ts:
-            ts = time (NULL);
-            if ((ts_fd = safe_openatm(AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC, LOGFILE_PERMS)) < 0) {
-                /* TODO: Warn in close failures. */
-                safe_close(out_fd);
-                die ("Unable to write timestamp to '%s', %s\n", directory, ERRSTR);
+    for (;;) {
+        if (procq.count)
+            processor_run ();
+
+        int timeout = -1;
+        for (struct logdir *ld = logdirs; ld < logdirs + n_logdirs; ld++) {
+            /* Finish the last rotation before waiting for more input. */
+            if (ld->prev_fd >= 0) {
+                finish_rotate (ld);
+                open_next (ld);
             }
-            ts_file = safe_fdopen(ts_fd, "w");
-            assert (ts_file != NULL);
-
-            if (fprintf (ts_file, "%lu\n", (unsigned long) ts) < 0)
-                die ("Unable to write to '%s': %s\n", path, ERRSTR);
-        }
-        else {
-            unsigned long long ts_;
 
-            if (fscanf (ts_file, "%llu", &ts_) != 1 || ferror (ts_file)) {
-                fclose (ts_file);
-                goto recreate_ts;
+            timeout = min_timeout (timeout, rotate_timeout (ld));
+            if (ld->retry) {
+                const time_t now = time (NULL);
+                if (ld->retry > now)
+                    timeout = min_timeout (timeout, (ld->retry - now) * 1000);
+                else
+                    write_held (ld);
+            }
+            if (ld->unsynced && syncmsec) {
+                const unsigned long long elapsed = msec_since (&ld->syncfirst);
+                if (elapsed >= syncmsec)
+                    sync_log (ld);
+                else
+                    timeout = min_timeout (timeout, syncmsec - elapsed);
             }
-            ts = ts_;
         }
-		/* TODO: Warn on errors. */
-        fclose (ts_file);
-        ts_file = NULL;
+        if (procq.count)
+            timeout = min_timeout (timeout, PROCESSOR_POLL_MSEC);
+
+        /* Pending writes are completed while waiting for input. */
+        const bool writing = ring && (inflight || inflight_syncs);
+        if (writing)
+            timeout = min_timeout (timeout, batch_retry_timeout ());
+
+        /*
+         * With data already in the ring there is no waiting, but signals
+         * must still be handled under sustained input: pick them up
+         * without blocking.
+         */
+        const int input_fd = input_poll_fd ();
+        if (input_fd < 0) {
+            handle_signals ();
+            return;
+        }
 
-        curtime = ts;
-        if (maxtime) {
-            curtime -= (curtime % maxtime);
+        struct pollfd pfd[3] = {
+            { .fd = input_fd, .events = POLLIN },
+            { .fd = signal_fd, .events = POLLIN },
+            { .fd = writing ? uring_fd (ring) : -1, .events = POLLIN },
+        };
+        if (poll (pfd, 3, timeout) < 0) {
+            if (errno != EINTR)
+                die ("Cannot wait for input: %s\n", ERRSTR);
+            continue;
         }
-        cursize = (unsigned long long) lseek (out_fd, 0, SEEK_CUR);
+        if (pfd[1].revents)
+            handle_signals ();
+        if (pfd[2].revents)
+            batch_reap ();
+        if (pfd[0].revents)
+            return;
     }
+}
 
-    if ((maxsize != 0) && (maxtime != 0)) {
-        if (cursize >= maxsize || (unsigned long long) now > (curtime + maxtime)) {
-            struct tm *time_gm;
-            char path[MAXPATHLEN];
-            char newpath[MAXPATHLEN];
-
-            if (out_fd < 0) {
-                die ("Internal inconsistency at %s:%i\n", __FILE__, __LINE__);
-                assert (!"unreachable");
-            }
 
-            if ((time_gm = gmtime(&now)) == NULL)
-                die ("Unable to get current date: %s\n", ERRSTR);
+static bool
+selector_matches (const struct selector *sel, const uint8_t *data, size_t len)
+{
+    if (!sel->is_regex)
+        return len >= sel->len && !memcmp (data, sel->text, sel->len);
+
+#ifdef REG_STARTEND
+    regmatch_t match = { .rm_so = 0, .rm_eo = len };
+    return regexec (&sel->regex, (const char*) data, 1, &match, REG_STARTEND) == 0;
+#else
+    static struct dbuf text = DBUF_INIT;
+    dbuf_clear (&text);
+    dbuf_addmem (&text, data, len);
+    return regexec (&sel->regex, dbuf_str (&text), 0, NULL, 0) == 0;
+#endif /* REG_STARTEND */
+}
 
-            if (snprintf (newpath, sizeof (newpath), "%s/" LOGFILE_PREFIX, directory) < 0)
-                die ("Path name too long: %s\n", directory);
 
-            if (strftime (newpath + strlen (newpath),
-                          sizeof (newpath) - strlen(newpath),
-                          "%Y-%m-%d-%H:%M:%S",
-                          time_gm) == 0)
-                die ("Path name too long: '%s'\n", directory);
+/* Checks whether a line (without its newline) is written to a directory. */
+static bool
+logdir_selects (const struct logdir *ld, const uint8_t *data, size_t len)
+{
+    bool selected = true;
 
-            if (snprintf(path, sizeof (path), "%s/" LOGFILE_CURRENT, directory) < 0)
-                die ("Path name too long: %s\n", directory);
+    for (const struct logdir *d = logdirs; d <= ld; d++)
+        for (size_t i = 0; i < d->n_selectors; i++)
+            if (d->selectors[i].select != selected &&
+                selector_matches (&d->selectors[i], data, len))
+                selected = !selected;
 
-            rotate_log ();
+    return selected;
+}
 
-			/* TODO: Warn on close errors. */
-            safe_close(out_fd);
-            out_fd = -1;
 
-            if (rename (path, newpath) < 0 && unlink (path) < 0)
-                die ("Unable to rename '%s' to '%s'\n", path, newpath);
+static void
+write_lines (struct logdir *ld, struct iovec *iov, int n_iov)
+{
+    for (;;) {
+        /* Data kept earlier goes first, retried only once in a while. */
+        if (ld->retry) {
+            if (ld->retry > time (NULL) || !write_held (ld)) {
+                if (hold_data (ld, iov, n_iov))
+                    return;
+                safe_sleep (FULL_RETRY_DELAY);
+                continue;
+            }
+        }
 
-            if (snprintf (path, sizeof (path), "%s/" LOGDIR_TSTAMP, directory) < 0)
-                die ("Path name too long: %s\n", directory);
+        if (write_iov (ld, iov, n_iov))
+            return;
 
-            unlink (path);
-            goto testdir;
+        fprintf (stderr, "Cannot write to logfile: %s.\n", ERRSTR);
+        if (hold_data (ld, iov, n_iov)) {
+            ld->retry = time (NULL) + FULL_RETRY_DELAY;
+            return;
         }
+        safe_sleep (5);
+    }
+}
+
+
+/*
+ * Writes the lines accumulated in the line buffer which are selected for
+ * a log directory, using a single writev() call for all of them unless the
+ * log needs to be rotated in between.
+ */
+static void
+flush_logdir (struct logdir *ld, const struct timespec *now, size_t timebuf_len)
+{
+    static struct iovec *iov = NULL;
+    static size_t iov_alloc = 0;
+
+    /*
+     * Logs closed on SIGHUP are reopened only to write new lines, and
+     * not when closing them again or quitting, or "current" would be
+     * created without anything being written to it.
+     */
+    if (ld->out_fd < 0) {
+        if (dbuf_empty(&line))
+            return;
+        open_log (ld);
     }
 
-    if (dbuf_empty(&line) || (skip_empty && dbuf_size(&line) == 1))
+    check_rotate (ld, now->tv_sec);
+
+    if (dbuf_empty(&line))
         return;
 
-    char timebuf[TSTAMP_LEN+1];
-    struct iovec iov[2];
+    const uint8_t *data = dbuf_cdata(&line);
+    const size_t size = dbuf_size(&line);
+    unsigned long long batchsize = 0;
+    struct batch *b = ring ? batch_get () : NULL;
+    size_t pos = 0;
     int n_iov = 0;
 
-    if (timestamp) {
-        struct tm *time_gm = gmtime (&now);
-        size_t timebuf_len;
+    while (pos < size) {
+        const uint8_t *nl = memchr(data + pos, '\n', size - pos);
+        const size_t len = nl ? (size_t) (nl - (data + pos) + 1) : size - pos;
 
-        if ((timebuf_len = strftime (timebuf, TSTAMP_LEN+1, TSTAMP_FMT, time_gm)) == 0)
-            die ("Cannot format timestamp\n");
+        if ((skip_empty && nl && len == 1) ||
+            (selecting && !logdir_selects (ld, data + pos, nl ? len - 1 : len))) {
+            pos += len;
+            continue;
+        }
 
-        iov[n_iov++] = iov_from_data (timebuf, timebuf_len);
-    }
+        if (rotation_enabled (ld) && ld->cursize + batchsize >= ld->maxsize) {
+            if (b) {
+                batch_submit (ld, b);
+                check_rotate (ld, now->tv_sec);
+                b = batch_get ();
+            } else {
+                write_lines (ld, iov, n_iov);
+                check_rotate (ld, now->tv_sec);
+            }
+            batchsize = 0;
+            n_iov = 0;
+        }
 
-    iov[n_iov++] = iov_from_buffer (&line);
-    assert ((unsigned) n_iov <= (sizeof (iov) / sizeof (iov[0])));
+        if (ld->index_fd >= 0)
+            write_index (ld, now, batchsize);
+        if (ld->trigrams)
+            add_trigrams (ld, tstamp.buf, timebuf_len, data + pos, len);
+
+        if (b) {
+            if (timestamp)
+                batch_add (b, tstamp.buf, timebuf_len);
+            batch_add (b, data + pos, len);
+            batchsize += timebuf_len + len;
+            pos += len;
+            continue;
+        }
 
-    for (;;) {
-        ssize_t r = safe_writev(out_fd, iov, n_iov);
-        if (r > 0) {
-            cursize += r;
-            break;
+        if (iov_alloc < (size_t) n_iov + 2) {
+            iov_alloc = iov_alloc ? iov_alloc * 2 : 64;
+            iov = reallocarray(iov, iov_alloc, sizeof (struct iovec));
         }
 
-        fprintf (stderr, "Cannot write to logfile: %s.\n", ERRSTR);
-        safe_sleep (5);
+        if (timestamp) {
+            iov[n_iov++] = iov_from_data (tstamp.buf, timebuf_len);
+            batchsize += timebuf_len;
+        }
+        iov[n_iov++] = iov_from_data ((void*) (data + pos), len);
+        batchsize += len;
+        pos += len;
     }
 
-    if (!buffered) {
-		/* TODO: Warn on errors. */
-        safe_fsync(out_fd);
-	}
+    if (b)
+        batch_submit (ld, b);
+    else
+        write_lines (ld, iov, n_iov);
+}
+
+
+static void
+flush_lines (void)
+{
+    struct timespec now;
+    tstamp_clock (&tstamp, &now);
+
+    size_t timebuf_len = 0;
 
+    if (timestamp && !dbuf_empty(&line) &&
+        (timebuf_len = tstamp_update (&tstamp, &now)) == 0)
+        die ("Cannot format timestamp\n");
+
+    for (struct logdir *ld = logdirs; ld < logdirs + n_logdirs; ld++)
+        flush_logdir (ld, &now, timebuf_len);
     dbuf_clear(&line);
 }
 
 
 static void
-close_log (void)
+close_log (struct logdir *ld)
 {
-    flush_line ();
+    if (ld->out_fd < 0)
+        return;
+
+    if (ld->retry && !write_held (ld))
+        fprintf (stderr, "Unable to write %zu bytes to '%s', %llu lines were dropped.\n",
+                 dbuf_size (&ld->held), ld->path, ld->dropped);
+
+    sync_log (ld);
+    if (ring)
+        batch_drain ();
+    trim_log (ld->out_fd);
+    finish_rotate (ld);
+
+    if (ld->next_fd >= 0) {
+        trim_log (ld->next_fd);
+        safe_close(ld->next_fd);
+        ld->next_fd = -1;
+    }
+
+    if (ld->index_fd >= 0) {
+        safe_close(ld->index_fd);
+        ld->index_fd = -1;
+    }
 
     for (;;) {
-        if (safe_close(out_fd) == 0) {
-            out_fd = -1;
+        if (safe_close(ld->out_fd) == 0) {
+            ld->out_fd = -1;
             break;
         }
 
         fprintf (stderr, "Unable to close logfile at directory '%s', %s\n",
-                 directory, ERRSTR);
+                 ld->path, ERRSTR);
         safe_sleep (5);
     }
 }
 
 
 static void
-roll_handler (int signum)
+close_logs (void)
 {
-    (void) signum;
-    close_log ();
+    flush_lines ();
+    for (struct logdir *ld = logdirs; ld < logdirs + n_logdirs; ld++)
+        close_log (ld);
 }
 
 
 __attribute__((noreturn))
 static void
-quit_handler (int signum)
+quit (void)
 {
-    (void) signum;
-
-    flush_line ();
+    flush_lines ();
+    if (input.data)
+        input_take (&overflow);
     dbuf_addbuf(&line, &overflow);
-    close_log ();
+    close_logs ();
     exit (returncode);
 }
 
 
+static void
+signal_pipe_handler (int signum)
+{
+    const int saved_errno = errno;
+    const unsigned char c = signum;
+    if (write (signal_pipe[1], &c, 1) < 0) {
+        /* The pipe is full, there are signals to handle already. */
+    }
+    errno = saved_errno;
+}
+
+
+static void
+setup_signals (void)
+{
+    sigset_t set;
+    sigemptyset (&set);
+    for (size_t i = 0; i < sizeof (handled_signals) / sizeof (handled_signals[0]); i++)
+        sigaddset (&set, handled_signals[i]);
+
+    sigprocmask (SIG_BLOCK, &set, &signals_mask);
+#if HAVE_SIGNALFD
+    if ((signal_fd = signalfd (-1, &set, SFD_CLOEXEC | SFD_NONBLOCK)) >= 0)
+        return;
+#endif /* HAVE_SIGNALFD */
+
+    if (pipe2 (signal_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+        die ("Cannot create pipe: %s\n", ERRSTR);
+    signal_fd = signal_pipe[0];
+
+    struct sigaction sa;
+    sigemptyset (&sa.sa_mask);
+    sa.sa_flags = 0;
+    sa.sa_handler = signal_pipe_handler;
+    safe_sigaction ("HUP", SIGHUP, &sa);
+    safe_sigaction ("INT", SIGINT, &sa);
+    safe_sigaction ("TERM", SIGTERM, &sa);
+    safe_sigaction ("USR1", SIGUSR1, &sa);
+    sigprocmask (SIG_SETMASK, &signals_mask, NULL);
+}
+
+
+/* Handles the signals received since the last call. */
+static void
+handle_signals (void)
+{
+    for (;;) {
+        int signum;
+#if HAVE_SIGNALFD
+        if (signal_pipe[0] < 0) {
+            struct signalfd_siginfo info;
+            if (read (signal_fd, &info, sizeof (info)) != sizeof (info))
+                return;
+            signum = info.ssi_signo;
+        } else
+#endif /* HAVE_SIGNALFD */
+        {
+            unsigned char c;
+            if (read (signal_fd, &c, 1) != 1)
+                return;
+            signum = c;
+        }
+
+        switch (signum) {
+            case SIGHUP:
+                close_logs ();
+                break;
+            case SIGUSR1:
+                if (input.data)
+                    input_stats ();
+                break;
+            default:
+                quit ();
+        }
+    }
+}
+
+
 static const struct cflag drlog_options[] = {
     CFLAG(uint, "max-files", 'm', &maxfiles,
           "Maximum number of log files to keep."),
@@ -355,62 +2134,244 @@ static const struct cflag drlog_options[] = {
           "Maximum time to use a log file (suffixes: mhdwMy)."),
     CFLAG(bytes, "max-size", 's', &maxsize,
           "Maximum size of each log file (suffixes: kmg)."),
+    CFLAG(bytes, "max-total", 'M', &maxtotal,
+          "Maximum size of all log files together (suffixes: kmg)."),
+    CFLAG(uint, "min-files", 'k', &minfiles,
+          "Minimum number of log files to keep regardless of --max-total."),
     CFLAG(int, "input-fd", 'i', &in_fd,
           "File descriptor to read input from (default: stdin)."),
+    CFLAG(bytes, "ring-size", 'r', &ringsize,
+          "Read input in a separate thread, buffering up to this amount of data (suffixes: kmg)."),
     CFLAG(bool, "buffered", 'b', &buffered,
           "Buffered operation, do not flush to disk after each line."),
+    CFLAG(bytes, "sync-size", 'S', &syncsize,
+          "Flush to disk after writing this amount of data (suffixes: kmg)."),
+    CFLAG(uint, "sync-interval", 'I', &syncmsec,
+          "Flush to disk at most this many milliseconds after writing."),
+    CFLAG(uint, "io-uring", 'U', &uring_depth,
+          "Write using io_uring, with up to this many batches in flight."),
+    {
+        .name = "on-full", .letter = 'O',
+        .func = onfull_option,
+        .data = &onfull,
+        .help =
+            "What to do when writing fails: 'block' (default), or any of "
+            "'prune', 'buffer', and 'drop' separated by commas.",
+    },
+    CFLAG(bytes, "full-buffer", 'B', &fullbuf,
+          "Amount of data to keep in memory with --on-full=buffer (suffixes: kmg)."),
+    CFLAG(bytes, "index", 'x', &indexsize,
+          "Add a time index entry every given amount of bytes (0: disable)."),
+    CFLAG(bool, "bloom", 'g', &bloom,
+          "Save a Bloom filter of the contents of rotated files."),
+    CFLAG(bool, "preallocate", 'p', &prealloc,
+          "Reserve disk space for --max-size when opening a log file."),
     CFLAG(bool, "timestamp", 't', &timestamp,
           "Prepend a timestamp in YYYY-MM-DD/HH:MM:SS format to each line."),
+    {
+        .name = "timestamp-format", .letter = 'F',
+        .func = tstamp_format_option,
+        .data = &tstamp,
+        .help =
+            "Timestamp format: 'default', 'tai64n', 'rfc3339-us', "
+            "'rfc3339-ns', or 'epoch-ns'. Formats other than 'default' "
+            "imply --timestamp.",
+    },
     CFLAG(bool, "skip-empty", 'e', &skip_empty,
           "Ignore empty lines with no characters."),
+    CFLAG(bytes, "max-line", 'L', &maxline,
+          "Split lines longer than this amount of bytes (suffixes: kmg)."),
+    CFLAG(string, "continuation", 'C', &continuation,
+          "Mark added at the end of split lines (default: '" LINE_CONTINUATION "')."),
+    CFLAG(string, "processor", 'P', &processor,
+          "Shell command to run on each rotated file, passed as \"$1\"."),
+    CFLAG(uint, "processor-jobs", 'J', &procjobs,
+          "Maximum number of processor commands running at once (default: 1)."),
+    CFLAG(int, "processor-nice", 'N', &procnice,
+          "Niceness increment for processor commands (default: 10)."),
+    CFLAG(bool, "processor-idle", '\0', &procidle,
+          "Run processor commands in the idle I/O scheduling class."),
     CFLAG_HELP,
     CFLAG_END
 };
 
+/* Options which can be changed for each log directory, see parse_script(). */
+#define LOGDIR_SETTINGS "mTsMk"
+
+
+static void
+add_logdir (const char *path, struct selector *selectors, size_t n_selectors)
+{
+    logdirs = reallocarray(logdirs, n_logdirs + 1, sizeof (struct logdir));
+    if (!logdirs)
+        die ("Cannot allocate memory\n");
+
+    struct logdir *ld = &logdirs[n_logdirs++];
+    *ld = (struct logdir) {
+        .path = path,
+        .out_fd = -1,
+        .next_fd = -1,
+        .prev_fd = -1,
+        .index_fd = -1,
+        .maxfiles = maxfiles,
+        .maxtime = maxtime,
+        .maxsize = maxsize,
+        .maxtotal = maxtotal,
+        .minfiles = minfiles,
+        .selectors = selectors,
+        .n_selectors = n_selectors,
+    };
+
+    if ((ld->fd = safe_openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        die ((errno == ENOENT)
+                 ? "Output directory does not exist: %s\n"
+                 : "Output path is not a directory: %s\n",
+              path);
+}
+
+
+/*
+ * Parses the arguments after the options: the first is always a log
+ * directory, then each of the rest is either a selector ("+TEXT", "-TEXT",
+ * "+~REGEX", "-~REGEX"), a setting for the log directories which follow
+ * (e.g. "s10m" is like "--max-size 10m"), or another log directory, whose
+ * path must start with "." or "/".
+ */
+static void
+parse_script (const char *argv0, int argc, char **argv)
+{
+    struct selector *selectors = NULL;
+    size_t n_selectors = 0;
+
+    for (int i = 0; i < argc; i++) {
+        const char *item = argv[i];
+
+        if (i == 0 || item[0] == '.' || item[0] == '/') {
+            add_logdir (item, selectors, n_selectors);
+            selectors = NULL;
+            n_selectors = 0;
+        } else if (item[0] == '+' || item[0] == '-') {
+            selectors = reallocarray(selectors, n_selectors + 1, sizeof (struct selector));
+            if (!selectors)
+                die ("%s: Cannot allocate memory\n", argv0);
+
+            struct selector *sel = &selectors[n_selectors++];
+            *sel = (struct selector) {
+                .select = item[0] == '+',
+                .is_regex = item[1] == '~',
+                .text = item + 1,
+                .len = strlen (item + 1),
+            };
+
+            int err;
+            if (sel->is_regex &&
+                (err = regcomp (&sel->regex, item + 2, REG_EXTENDED | REG_NOSUB)) != 0) {
+                char msg[128];
+                regerror (err, &sel->regex, msg, sizeof (msg));
+                die ("%s: Invalid regular expression '%s': %s\n", argv0, item + 2, msg);
+            }
+            selecting = true;
+        } else if (item[0] && strchr (LOGDIR_SETTINGS, item[0])) {
+            const struct cflag *spec = drlog_options;
+            while (spec->letter != item[0])
+                spec++;
+
+            const enum cflag_status status = (*spec->func) (spec, item + 1);
+            if (status != CFLAG_OK)
+                die ("%s: %s: '%s'\n", argv0, cflag_status_name (status), item);
+        } else {
+            die ("%s: Invalid argument: '%s'\n", argv0, item);
+        }
+    }
+
+    if (n_selectors)
+        die ("%s: No log directory after the last selector.\n", argv0);
+}
+
+
 int drlog_main (int argc, char **argv)
 {
-    int in_fd = STDIN_FILENO;
     char *env_opts = NULL;
     struct sigaction sa;
 
     if ((env_opts = getenv ("DRLOG_OPTIONS")) != NULL)
         replace_args_string (env_opts, &argc, &argv);
 
-    const char *argv0 = cflag_apply(drlog_options, "[options] logdir-path", &argc, &argv);
+    const char *argv0 = cflag_apply(drlog_options, "[options] logdir-path [selector | setting | logdir-path]...", &argc, &argv);
+
+    if (tstamp.format != TSTAMP_DEFAULT)
+        timestamp = true;
 
     if (!argc)
         die ("%s: No log directory path was specified.\n", argv0);
 
-	/* TODO: Open a fd handle to the directory to use *at() functions afterwards. */
-    directory = argv[0];
+    parse_script (argv0, argc, argv);
 
-    sigemptyset (&sa.sa_mask);
-    sa.sa_flags = 0;
+    if (processor) {
+        if (!procjobs)
+            die ("%s: --processor-jobs must be at least 1.\n", argv0);
 
-    sa.sa_handler = roll_handler;
-    safe_sigaction ("HUP", SIGHUP, &sa);
+        /* Pass the file name as positional argument, avoiding quoting. */
+        const size_t len = strlen (processor);
+        char *command = malloc (len + sizeof (" \"$1\""));
+        memcpy (command, processor, len);
+        memcpy (command + len, " \"$1\"", sizeof (" \"$1\""));
+        processor = command;
+    }
 
-    sa.sa_handler = quit_handler;
-    safe_sigaction ("INT", SIGINT, &sa);
+    /* Batches in flight are retried, only pruning applies to them. */
+    if (uring_depth && (onfull & (FULL_BUFFER | FULL_DROP)))
+        die ("%s: --on-full buffer and drop cannot be used with --io-uring.\n", argv0);
+
+    if (uring_depth) {
+        /* Each batch needs up to two entries: write, and sync. */
+        if ((ring = uring_new (uring_depth * 2 + 2)) == NULL) {
+            fprintf (stderr, "%s: Cannot use io_uring, falling back to blocking writes: %s.\n",
+                     argv0, ERRSTR);
+            uring_depth = 0;
+        } else if ((batches = calloc (uring_depth, sizeof (struct batch))) == NULL) {
+            die ("%s: Cannot allocate memory\n", argv0);
+        }
+    }
 
-    sa.sa_handler = quit_handler;
-    safe_sigaction ("TERM", SIGTERM, &sa);
+    for (struct logdir *ld = logdirs; ld < logdirs + n_logdirs; ld++)
+        logfiles_scan (ld);
+
+    setup_signals ();
+
+    if (ringsize)
+        input_start ();
+
+    /* Processor jobs are reaped with waitpid(), they must not be ignored. */
+    if (processor) {
+        sigemptyset (&sa.sa_mask);
+        sa.sa_flags = 0;
+        sa.sa_handler = SIG_DFL;
+        safe_sigaction ("CHLD", SIGCHLD, &sa);
+    }
 
     for (;;) {
-        ssize_t bytes = freadline (in_fd, &line, &overflow, 0);
+        wait_input ();
+
+        ssize_t bytes = input_read (&overflow);
         if (bytes == 0)
             break; /* EOF */
 
         if (bytes < 0) {
             fprintf (stderr, "Unable to read from standard input: %s.\n", ERRSTR);
             returncode = 1;
-            quit_handler (0);
+            quit ();
         }
 
-        flush_line ();
+        /* Only look for lines in the overflow when new ones may be there. */
+        const uint8_t *data = dbuf_cdata (&overflow) + dbuf_size (&overflow) - bytes;
+        if (memchr (data, '\n', bytes) || (maxline && dbuf_size (&overflow) >= maxline)) {
+            drainlines_max (&line, &overflow, maxline, continuation);
+            flush_lines ();
+        }
     }
 
-    quit_handler (0);
+    quit ();
     return 0; /* Keep compiler happy */
 }
 
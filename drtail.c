@@ -0,0 +1,309 @@
+/*
+ * drtail.c
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE
+
+#include "deps/cflag/cflag.h"
+#include "logfile.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<sys/inotify.h>)
+#  include <sys/inotify.h>
+#  define HAVE_INOTIFY 1
+# endif
+#endif
+
+#ifndef HAVE_INOTIFY
+#define HAVE_INOTIFY 0
+#endif /* !HAVE_INOTIFY */
+
+#if !(defined(MULTICALL) && MULTICALL)
+# define drtail_main main
+#endif /* MULTICALL */
+
+#ifndef READ_SIZE
+#define READ_SIZE (256 * 1024)
+#endif /* !READ_SIZE */
+
+#ifndef EVENTS_SIZE
+#define EVENTS_SIZE (16 * 1024)
+#endif /* !EVENTS_SIZE */
+
+
+static unsigned lines = 10;
+
+static const char *argv0 = NULL;
+
+#if HAVE_INOTIFY
+static const char *dirpath = NULL;
+static int         dirfd = -1;
+
+/* The file being followed, which is "current" or was renamed from it. */
+static int         followed = -1;
+static struct stat followed_st;
+
+/* Key of the log file written before the followed one, if any. */
+static unsigned long long previous_key = 0;
+
+static uint8_t buffer[READ_SIZE];
+
+
+static inline bool
+same_file (const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+
+/* Writes what was appended to the followed file since the last read. */
+static void
+drain (void)
+{
+    ssize_t r;
+    while ((r = safe_read (followed, buffer, sizeof (buffer))) > 0) {
+        struct iovec iov = iov_from_data (buffer, r);
+        if (writev_all(STDOUT_FILENO, &iov, 1) < 0)
+            die ("%s: Cannot write output: %s\n", argv0, ERRSTR);
+    }
+    if (r < 0)
+        die ("%s: Cannot read from '%s': %s\n", argv0, dirpath, ERRSTR);
+}
+
+
+/* Returns false if the file does not exist (anymore). */
+static bool
+follow (const char *name)
+{
+    const int fd = safe_openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return false;
+        die ("%s: Cannot open '%s/%s': %s\n", argv0, dirpath, name, ERRSTR);
+    }
+
+    if (followed >= 0)
+        safe_close(followed);
+    followed = fd;
+
+    if (fstat (followed, &followed_st) < 0)
+        die ("%s: Cannot stat '%s/%s': %s\n", argv0, dirpath, name, ERRSTR);
+    return true;
+}
+
+
+/* Moves the position of the followed file to the start of its last lines. */
+static void
+skip_lines (void)
+{
+    off_t start = 0;
+
+    if (!lines) {
+        start = followed_st.st_size;
+    } else if (followed_st.st_size > 1) {
+        /* The newline at the end of the file does not start a line. */
+        off_t limit = followed_st.st_size - 1;
+        unsigned found = 0;
+
+        while (limit > 0) {
+            const size_t chunk = limit < (off_t) sizeof (buffer) ? (size_t) limit : sizeof (buffer);
+            const ssize_t r = pread (followed, buffer, chunk, limit - chunk);
+            if (r != (ssize_t) chunk)
+                die ("%s: Cannot read from '%s': %s\n", argv0, dirpath, r < 0 ? ERRSTR : "Short read");
+
+            const uint8_t *nl;
+            size_t len = chunk;
+            while ((nl = memrchr (buffer, '\n', len)) != NULL) {
+                if (++found == lines) {
+                    start = limit - chunk + (nl - buffer) + 1;
+                    goto done;
+                }
+                len = nl - buffer;
+            }
+            limit -= chunk;
+        }
+    }
+
+done:
+    if (lseek (followed, start, SEEK_SET) < 0)
+        die ("%s: Cannot seek in '%s': %s\n", argv0, dirpath, ERRSTR);
+}
+
+
+/*
+ * Finds the file written after the followed one, which is normally the
+ * new "current". Files are listed because more than one rotation may have
+ * happened since the last check, and the ones in between must be read too.
+ * The followed file is looked up by inode; if it has been replaced by the
+ * output of a --processor, which keeps the key in its name, it is the
+ * first one after the file written before it.
+ */
+static bool
+successor (char *name, size_t size)
+{
+    size_t n;
+    struct logfile_entry *files = logfile_list (dirfd, dirpath, &n);
+
+    size_t i = n - (n && files[n - 1].key == ULLONG_MAX);
+    if (followed >= 0) {
+        size_t j = n;
+        while (j-- > 0) {
+            struct stat st;
+            if (files[j].key != ULLONG_MAX &&
+                fstatat (dirfd, files[j].name, &st, 0) == 0 &&
+                same_file (&st, &followed_st))
+                break;
+        }
+        if (j >= n)
+            for (j = 0; j < n && files[j].key <= previous_key; j++)
+                ;
+        if (j < n && files[j].key != ULLONG_MAX)
+            i = j + 1;
+    }
+
+    /* Files renamed by a --processor cannot be read, skip over them. */
+    for (; i < n; i++) {
+        if (files[i].key == ULLONG_MAX || logfile_plain (files[i].name))
+            break;
+        fprintf (stderr, "%s: Skipping '%s/%s', not a plain log file.\n",
+                 argv0, dirpath, files[i].name);
+    }
+
+    const bool found = i < n && (size_t) snprintf (name, size, "%s", files[i].name) < size;
+    if (found)
+        previous_key = i ? files[i - 1].key : 0;
+    logfile_list_free (files, n);
+    return found;
+}
+
+
+/*
+ * Called when "current" appears: if it is not the followed file, that one
+ * has been rotated, and drlog will not write to it anymore. It is read to
+ * the end before switching to the file written next, which is read from
+ * its start, so no lines are missed or repeated.
+ */
+static void
+check_rotation (void)
+{
+    char name[NAME_MAX + 1];
+    struct stat st;
+
+    for (;;) {
+        if (fstatat (dirfd, LOGFILE_CURRENT, &st, 0) < 0) {
+            /* In the middle of a rotation, there will be another event. */
+            if (errno == ENOENT)
+                return;
+            die ("%s: Cannot stat '%s/" LOGFILE_CURRENT "': %s\n", argv0, dirpath, ERRSTR);
+        }
+        if (followed >= 0 && same_file (&st, &followed_st))
+            return;
+
+        if (followed >= 0)
+            drain ();
+        if (!successor (name, sizeof (name)))
+            return;
+        if (follow (name))
+            drain ();
+    }
+}
+
+
+NORETURN static void
+watch_events (int inotify_fd)
+{
+    uint8_t events[EVENTS_SIZE] __attribute__((aligned (__alignof__ (struct inotify_event))));
+
+    for (;;) {
+        const ssize_t r = safe_read (inotify_fd, events, sizeof (events));
+        if (r <= 0)
+            die ("%s: Cannot read inotify events: %s\n", argv0, r < 0 ? ERRSTR : "End of file");
+
+        bool modified = false, rotated = false;
+        for (ssize_t pos = 0; pos < r;) {
+            const struct inotify_event *event = (const struct inotify_event*) (events + pos);
+            pos += sizeof (struct inotify_event) + event->len;
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                if (followed >= 0)
+                    drain ();
+                die ("%s: Directory '%s' was removed or renamed.\n", argv0, dirpath);
+            }
+            if (event->mask & IN_Q_OVERFLOW) {
+                modified = rotated = true;
+                continue;
+            }
+
+            /* Changes to hidden files (indexes, filters) are ignored. */
+            if (!event->len || strcmp (event->name, LOGFILE_CURRENT))
+                continue;
+            if (event->mask & IN_MODIFY)
+                modified = true;
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                rotated = true;
+        }
+
+        if (modified && followed >= 0)
+            drain ();
+        if (rotated)
+            check_rotation ();
+    }
+}
+#endif /* HAVE_INOTIFY */
+
+
+int
+drtail_main (int argc, char **argv)
+{
+    const struct cflag drtail_options[] = {
+        CFLAG(uint, "lines", 'n', &lines,
+              "Show this many of the last lines of the current file first (default: 10)."),
+        CFLAG_HELP,
+        CFLAG_END
+    };
+
+    argv0 = cflag_apply(drtail_options, "[options] logdir-path", &argc, &argv);
+
+    if (!argc)
+        die ("%s: No log directory path was specified.\n", argv0);
+    if (argc > 1)
+        die ("%s: Only one log directory can be followed.\n", argv0);
+
+#if HAVE_INOTIFY
+    dirpath = argv[0];
+    if ((dirfd = safe_openat(AT_FDCWD, dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        die ("%s: Unable to open directory '%s': %s\n", argv0, dirpath, ERRSTR);
+
+    /* Watch before opening "current", so no rotation goes unnoticed. */
+    const int inotify_fd = inotify_init1 (IN_CLOEXEC);
+    if (inotify_fd < 0 ||
+        inotify_add_watch (inotify_fd, dirpath,
+                           IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF |
+                           IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK) < 0)
+        die ("%s: Cannot watch directory '%s': %s\n", argv0, dirpath, ERRSTR);
+
+    char name[NAME_MAX + 1];
+    if (successor (name, sizeof (name)) && follow (name)) {
+        skip_lines ();
+        drain ();
+    }
+    check_rotation ();
+    watch_events (inotify_fd);
+#else
+    die ("%s: Following log directories is not supported in this system.\n", argv0);
+#endif /* HAVE_INOTIFY */
+}
+
+/* vim: expandtab shiftwidth=4 tabstop=4
+ */
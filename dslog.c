@@ -154,6 +154,8 @@ dslog_main (int argc, char **argv)
     int priority = name_to_priority (DEFAULT_PRIORITY);
     bool console = false;
     bool skip_empty = false;
+    size_t maxline = 0;
+    char *continuation = LINE_CONTINUATION;
     char *env_opts = NULL;
     struct dbuf linebuf = DBUF_INIT;
     struct dbuf overflow = DBUF_INIT;
@@ -177,6 +179,10 @@ dslog_main (int argc, char **argv)
               "Log to console if sending messages to logger fails."),
         CFLAG(bool, "skip-empty", 'e', &skip_empty,
               "Ignore empty lines with no characters."),
+        CFLAG(bytes, "max-line", 'L', &maxline,
+              "Split lines longer than this amount of bytes (suffixes: kmg)."),
+        CFLAG(string, "continuation", 'C', &continuation,
+              "Mark added at the end of split lines (default: '" LINE_CONTINUATION "')."),
         CFLAG_HELP,
         CFLAG_END
     };
@@ -199,7 +205,7 @@ dslog_main (int argc, char **argv)
     openlog (argv[0], flags, facility);
 
     while (running) {
-        ssize_t bytes = freadline (in_fd, &linebuf, &overflow, 0);
+        ssize_t bytes = freadline_max (in_fd, &linebuf, &overflow, maxline, continuation);
         if (bytes == 0)
             break; /* EOF */
 
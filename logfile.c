@@ -0,0 +1,206 @@
+/*
+ * logfile.c
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE
+
+#include "logfile.h"
+#include "util.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* "log-YYYY-mm-dd-HH:MM:SS", optionally followed by ".uuuuuu" */
+#define LOGFILE_NAME_LEN (sizeof (LOGFILE_PREFIX) - 1U + 19U)
+#define LOGFILE_USEC_LEN 7U
+
+
+bool
+logfile_key (const char *name, unsigned long long *key)
+{
+    struct tm tm = { .tm_isdst = 0 };
+    unsigned usec = 0;
+
+    if (strncmp (name, LOGFILE_PREFIX, sizeof (LOGFILE_PREFIX) - 1U))
+        return false;
+
+    const int n = sscanf (name, LOGFILE_PREFIX "%d-%d-%d-%d:%d:%d.%6u",
+                          &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                          &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &usec);
+    if (n != 6 && n != 7)
+        return false;
+
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+
+    const time_t t = timegm (&tm);
+    if (t < 0)
+        return false;
+
+    *key = t * 1000000ULL + usec;
+    return true;
+}
+
+
+/* Length of the name of a rotated file, without suffixes added later. */
+static size_t
+plain_length (const char *name)
+{
+    const size_t len = strlen (name);
+    unsigned long long key;
+
+    if (len < LOGFILE_NAME_LEN || !logfile_key (name, &key))
+        return len;
+
+    if (len >= LOGFILE_NAME_LEN + LOGFILE_USEC_LEN && name[LOGFILE_NAME_LEN] == '.' &&
+        strspn (name + LOGFILE_NAME_LEN + 1, "0123456789") >= LOGFILE_USEC_LEN - 1)
+        return LOGFILE_NAME_LEN + LOGFILE_USEC_LEN;
+    return LOGFILE_NAME_LEN;
+}
+
+
+bool
+logfile_plain (const char *name)
+{
+    unsigned long long key;
+    return plain_length (name) == strlen (name) && logfile_key (name, &key);
+}
+
+
+void
+logfile_name (char *name, size_t size, unsigned long long key)
+{
+    const time_t t = key / 1000000;
+    struct tm *time_gm;
+    size_t len;
+
+    if ((time_gm = gmtime (&t)) == NULL)
+        die ("Unable to get current date: %s\n", ERRSTR);
+
+    if ((len = strftime (name, size, LOGFILE_PREFIX "%Y-%m-%d-%H:%M:%S", time_gm)) == 0 ||
+        snprintf (name + len, size - len, ".%06u", (unsigned) (key % 1000000)) >= (int) (size - len))
+        die ("Unable to format log file name\n");
+}
+
+
+static int
+logfile_compare (const void *a, const void *b)
+{
+    const struct logfile_entry *la = a, *lb = b;
+    return (la->key > lb->key) - (la->key < lb->key);
+}
+
+
+struct logfile_entry*
+logfile_list (int dirfd, const char *path, size_t *count)
+{
+    struct logfile_entry *files = NULL;
+    size_t n = 0, alloc = 0;
+    struct dirent *dirent;
+    DIR *dir;
+    int fd;
+
+    /*
+     * fdopendir() takes ownership of the descriptor, pass a copy. Copies
+     * share the position, which has to be reset for listing again.
+     */
+    if ((fd = fcntl (dirfd, F_DUPFD_CLOEXEC, 0)) < 0 || (dir = fdopendir (fd)) == NULL)
+        die ("Unable to read directory '%s': %s\n", path, ERRSTR);
+    rewinddir (dir);
+
+    while ((dirent = readdir (dir)) != NULL) {
+        unsigned long long key;
+        if (!strcmp (dirent->d_name, LOGFILE_CURRENT))
+            key = ULLONG_MAX;
+        else if (!logfile_key (dirent->d_name, &key))
+            continue;
+
+        if (n == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            if ((files = reallocarray (files, alloc, sizeof (struct logfile_entry))) == NULL)
+                die ("Cannot allocate memory\n");
+        }
+        files[n].key = key;
+        files[n].name = strdup (dirent->d_name);
+        n++;
+    }
+    closedir (dir);
+
+    qsort (files, n, sizeof (struct logfile_entry), logfile_compare);
+    *count = n;
+    return files;
+}
+
+
+void
+logfile_list_free (struct logfile_entry *files, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        free (files[i].name);
+    free (files);
+}
+
+
+bool
+logfile_sidecar (char *path, size_t size, const char *name, const char *suffix)
+{
+    const int len = snprintf (path, size, ".%.*s%s", (int) plain_length (name), name, suffix);
+    return len > 0 && (size_t) len < size;
+}
+
+
+struct logindex_entry*
+logindex_read (int dirfd, const char *name, uint64_t size, size_t *count)
+{
+    char path[NAME_MAX + 1];
+    struct stat st;
+    int fd;
+
+    *count = 0;
+    if (!logfile_sidecar (path, sizeof (path), name, LOGINDEX_SUFFIX) ||
+        (fd = safe_openat(dirfd, path, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+
+    struct logindex_entry *entries = NULL;
+    if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (struct logindex_entry) ||
+        (entries = malloc (st.st_size)) == NULL) {
+        safe_close(fd);
+        return NULL;
+    }
+
+    /* A partially written entry at the end is ignored. */
+    size_t n = 0;
+    ssize_t r = 0;
+    while (n < (size_t) st.st_size &&
+           (r = safe_read (fd, (char*) entries + n, st.st_size - n)) > 0)
+        n += r;
+    safe_close(fd);
+    n /= sizeof (struct logindex_entry);
+
+    /* Keep only the entries which are consistent with the previous ones. */
+    size_t valid = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (entries[i].offset > size ||
+            (valid && (entries[i].offset <= entries[valid - 1].offset ||
+                       entries[i].time < entries[valid - 1].time)))
+            continue;
+        entries[valid++] = entries[i];
+    }
+
+    if (!valid) {
+        free (entries);
+        return NULL;
+    }
+    *count = valid;
+    return entries;
+}
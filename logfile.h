@@ -0,0 +1,80 @@
+/*
+ * logfile.h
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef __logfile_h__
+#define __logfile_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef LOGFILE_PREFIX
+#define LOGFILE_PREFIX "log-"
+#endif /* !LOGFILE_PREFIX */
+
+#ifndef LOGFILE_CURRENT
+#define LOGFILE_CURRENT "current"
+#endif /* !LOGFILE_CURRENT */
+
+#ifndef LOGINDEX_SUFFIX
+#define LOGINDEX_SUFFIX ".idx"
+#endif /* !LOGINDEX_SUFFIX */
+
+/*
+ * Rotated files are named after the time of the rotation with microsecond
+ * precision, and their keys are that time in microseconds since the epoch.
+ * Names from older versions, without the fractional part, are accepted.
+ * Files renamed by a --processor (e.g. "log-...zst") have valid keys, but
+ * are not plain log files.
+ */
+bool logfile_key (const char *name, unsigned long long *key);
+bool logfile_plain (const char *name);
+void logfile_name (char *name, size_t size, unsigned long long key);
+
+/*
+ * Lists the log files in a directory, oldest first, ending with "current"
+ * which gets the largest key.
+ */
+struct logfile_entry {
+    unsigned long long key;
+    char              *name;
+};
+
+struct logfile_entry* logfile_list (int dirfd, const char *path, size_t *count);
+void logfile_list_free (struct logfile_entry *files, size_t count);
+
+/*
+ * Data about a log file is kept in hidden files named after it, e.g.
+ * ".current.idx" for "current". Files renamed by a --processor keep
+ * the names of the ones of the original.
+ */
+bool logfile_sidecar (char *path, size_t size, const char *name, const char *suffix);
+
+/*
+ * Each log file may have a sparse time index, kept in a hidden file which
+ * is renamed along with it. The index is an array of entries in native
+ * byte order, one every --index bytes, which give the offset of the first
+ * line written at some time.
+ * Lines before the offset were written earlier than that time, and lines
+ * after it later, so readers can skip to the parts of files they need.
+ */
+struct logindex_entry {
+    uint64_t time;      /* Microseconds since the epoch */
+    uint64_t offset;
+};
+
+/*
+ * Reads the index of a log file with the given size, dropping entries
+ * which are out of order or beyond the end of the file. Returns NULL if
+ * there is no index.
+ */
+struct logindex_entry* logindex_read (int dirfd,
+                                      const char *name,
+                                      uint64_t size,
+                                      size_t *count);
+
+#endif /* !__logfile_h__ */
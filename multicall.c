@@ -15,7 +15,10 @@
 extern int denv_main(int, char**);
 extern int dlog_main(int, char**);
 extern int dmon_main(int, char**);
+extern int drcat_main(int, char**);
+extern int drgrep_main(int, char**);
 extern int drlog_main(int, char**);
+extern int drtail_main(int, char**);
 extern int dslog_main(int, char**);
 
 static const struct {
@@ -25,7 +28,10 @@ static const struct {
 	{ .name = "denv", .func = denv_main },
     { .name = "dmon", .func = dmon_main },
     { .name = "dlog", .func = dlog_main },
+    { .name = "drcat", .func = drcat_main },
+    { .name = "drgrep", .func = drgrep_main },
     { .name = "drlog", .func = drlog_main },
+    { .name = "drtail", .func = drtail_main },
     { .name = "dslog", .func = dslog_main },
 	{ .name = "envdir", .func = denv_main },
 };
@@ -0,0 +1,301 @@
+/*
+ * tstamp.c
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE
+
+#include "tstamp.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define SECS_PER_DAY (24 * 60 * 60)
+
+/* TAI64 label of the Unix epoch: 2^62, plus 10 seconds TAI-UTC offset. */
+#define TAI64_EPOCH 4611686018427387914ULL
+
+/* Offsets in "YYYY-mm-dd/HH:MM:SS" */
+#define OFF_HOUR 11
+#define OFF_MIN  14
+#define OFF_SEC  17
+#define DATE_LEN 19
+
+
+static inline void
+put_digits (char *p, unsigned long long value, unsigned ndigits)
+{
+    while (ndigits--) {
+        p[ndigits] = '0' + value % 10;
+        value /= 10;
+    }
+}
+
+
+static inline void
+put_hex (char *p, unsigned long long value, unsigned ndigits)
+{
+    static const char digits[] = "0123456789abcdef";
+    while (ndigits--) {
+        p[ndigits] = digits[value & 0xF];
+        value >>= 4;
+    }
+}
+
+
+/*
+ * Renders the date and time of day, with "sep" in between. When the day
+ * has not changed since the previous second, only the changed fields of
+ * the time of day are rendered.
+ */
+static bool
+render_datetime (struct tstamp *t, time_t sec, char sep)
+{
+    if (t->sec < 0 || sec < 0 || sec / SECS_PER_DAY != t->sec / SECS_PER_DAY) {
+        struct tm tm;
+        if (gmtime_r (&sec, &tm) == NULL)
+            return false;
+
+        put_digits (t->buf, tm.tm_year + 1900, 4);
+        t->buf[4] = '-';
+        put_digits (t->buf + 5, tm.tm_mon + 1, 2);
+        t->buf[7] = '-';
+        put_digits (t->buf + 8, tm.tm_mday, 2);
+        t->buf[10] = sep;
+        put_digits (t->buf + OFF_HOUR, tm.tm_hour, 2);
+        t->buf[OFF_MIN - 1] = ':';
+        put_digits (t->buf + OFF_MIN, tm.tm_min, 2);
+        t->buf[OFF_SEC - 1] = ':';
+        put_digits (t->buf + OFF_SEC, tm.tm_sec, 2);
+    } else {
+        const unsigned day_sec = sec % SECS_PER_DAY;
+        if (day_sec / 60 != t->sec % SECS_PER_DAY / 60) {
+            put_digits (t->buf + OFF_HOUR, day_sec / 3600, 2);
+            put_digits (t->buf + OFF_MIN, day_sec / 60 % 60, 2);
+        }
+        put_digits (t->buf + OFF_SEC, day_sec % 60, 2);
+    }
+    return true;
+}
+
+
+static bool
+render_second (struct tstamp *t, time_t sec)
+{
+    switch (t->format) {
+        case TSTAMP_DEFAULT:
+            if (!render_datetime (t, sec, '/'))
+                return false;
+            t->buf[DATE_LEN] = ' ';
+            t->frac = t->len = DATE_LEN + 1;
+            break;
+
+        case TSTAMP_RFC3339_US:
+        case TSTAMP_RFC3339_NS:
+            if (!render_datetime (t, sec, 'T'))
+                return false;
+            t->buf[DATE_LEN] = '.';
+            t->frac = DATE_LEN + 1;
+            t->len = t->frac + (t->format == TSTAMP_RFC3339_US ? 6 : 9);
+            t->buf[t->len++] = 'Z';
+            t->buf[t->len++] = ' ';
+            break;
+
+        case TSTAMP_TAI64N:
+            t->buf[0] = '@';
+            put_hex (t->buf + 1, TAI64_EPOCH + sec, 16);
+            t->frac = 17;
+            t->len = t->frac + 8;
+            t->buf[t->len++] = ' ';
+            break;
+
+        case TSTAMP_EPOCH_NS: {
+            unsigned long long value = (sec < 0) ? 0 : sec;
+            unsigned ndigits = 1;
+            for (unsigned long long v = value; v >= 10; v /= 10)
+                ndigits++;
+            put_digits (t->buf, value, ndigits);
+            t->frac = ndigits;
+            t->len = t->frac + 9;
+            t->buf[t->len++] = ' ';
+            break;
+        }
+    }
+
+    assert (t->len <= TSTAMP_MAXLEN);
+    t->sec = sec;
+    return true;
+}
+
+
+void
+tstamp_clock (const struct tstamp *t, struct timespec *now)
+{
+#ifdef CLOCK_REALTIME_COARSE
+    if (t->format == TSTAMP_DEFAULT &&
+        clock_gettime (CLOCK_REALTIME_COARSE, now) == 0)
+        return;
+#else
+    (void) t;
+#endif /* CLOCK_REALTIME_COARSE */
+    clock_gettime (CLOCK_REALTIME, now);
+}
+
+
+size_t
+tstamp_update (struct tstamp *t, const struct timespec *now)
+{
+    if (now->tv_sec != t->sec && !render_second (t, now->tv_sec)) {
+        t->sec = -1;
+        return t->len = 0;
+    }
+
+    switch (t->format) {
+        case TSTAMP_DEFAULT:
+            break;
+        case TSTAMP_TAI64N:
+            put_hex (t->buf + t->frac, now->tv_nsec, 8);
+            break;
+        case TSTAMP_RFC3339_US:
+            put_digits (t->buf + t->frac, now->tv_nsec / 1000, 6);
+            break;
+        case TSTAMP_RFC3339_NS:
+        case TSTAMP_EPOCH_NS:
+            put_digits (t->buf + t->frac, now->tv_nsec, 9);
+            break;
+    }
+    return t->len;
+}
+
+
+static inline bool
+get_digits (const char *p, unsigned ndigits, unsigned long long *value)
+{
+    *value = 0;
+    while (ndigits--) {
+        if (*p < '0' || *p > '9')
+            return false;
+        *value = *value * 10 + (*p++ - '0');
+    }
+    return true;
+}
+
+
+static inline bool
+get_hex (const char *p, unsigned ndigits, unsigned long long *value)
+{
+    *value = 0;
+    while (ndigits--) {
+        unsigned digit;
+        if (*p >= '0' && *p <= '9')
+            digit = *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            digit = *p - 'a' + 10;
+        else
+            return false;
+        *value = (*value << 4) | digit;
+        p++;
+    }
+    return true;
+}
+
+
+/* Days since the epoch for a date in the proleptic Gregorian calendar. */
+static long long
+days_from_civil (long long y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    const long long era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = (unsigned) (y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long long) doe - 719468;
+}
+
+
+static size_t
+parse_datetime (const char *text, size_t len, struct timespec *ts)
+{
+    unsigned long long year, mon, day, hour, min, sec;
+
+    if (len < DATE_LEN || text[4] != '-' || text[7] != '-' ||
+        (text[10] != '/' && text[10] != 'T' && text[10] != ' ') ||
+        text[OFF_MIN - 1] != ':' || text[OFF_SEC - 1] != ':' ||
+        !get_digits (text, 4, &year) || !get_digits (text + 5, 2, &mon) ||
+        !get_digits (text + 8, 2, &day) || !get_digits (text + OFF_HOUR, 2, &hour) ||
+        !get_digits (text + OFF_MIN, 2, &min) || !get_digits (text + OFF_SEC, 2, &sec) ||
+        mon < 1 || mon > 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+        return 0;
+
+    ts->tv_sec = days_from_civil (year, mon, day) * SECS_PER_DAY +
+        hour * 3600 + min * 60 + sec;
+    ts->tv_nsec = 0;
+
+    size_t pos = DATE_LEN;
+    if (pos < len && text[pos] == '.') {
+        unsigned long long scale = 100000000;
+        while (++pos < len && text[pos] >= '0' && text[pos] <= '9') {
+            ts->tv_nsec += (text[pos] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    if (pos < len && text[pos] == 'Z')
+        pos++;
+    return pos;
+}
+
+
+size_t
+tstamp_parse (const char *text, size_t len, struct timespec *ts)
+{
+    unsigned long long value, nsec;
+    size_t pos;
+
+    if (len >= 25 && text[0] == '@' && get_hex (text + 1, 16, &value) &&
+        get_hex (text + 17, 8, &nsec) && value >= TAI64_EPOCH && nsec < 1000000000) {
+        ts->tv_sec = value - TAI64_EPOCH;
+        ts->tv_nsec = nsec;
+        pos = 25;
+    } else if ((pos = parse_datetime (text, len, ts)) == 0) {
+        /* Nanoseconds since the epoch, at least as many digits as 2001. */
+        for (value = 0; pos < len && text[pos] >= '0' && text[pos] <= '9'; pos++)
+            value = value * 10 + (text[pos] - '0');
+        if (pos < 19 || pos > 20)
+            return 0;
+        ts->tv_sec = value / 1000000000;
+        ts->tv_nsec = value % 1000000000;
+    }
+
+    return (pos == len || text[pos] == ' ') ? pos : 0;
+}
+
+
+enum cflag_status
+tstamp_format_option (const struct cflag *spec, const char *arg)
+{
+    if (!spec)
+        return CFLAG_NEEDS_ARG;
+
+    static const struct {
+        const char     *name;
+        tstamp_format_t format;
+    } formats[] = {
+        { "default",    TSTAMP_DEFAULT    },
+        { "tai64n",     TSTAMP_TAI64N     },
+        { "rfc3339-us", TSTAMP_RFC3339_US },
+        { "rfc3339-ns", TSTAMP_RFC3339_NS },
+        { "epoch-ns",   TSTAMP_EPOCH_NS   },
+    };
+
+    for (unsigned i = 0; i < sizeof (formats) / sizeof (formats[0]); i++) {
+        if (!strcmp (arg, formats[i].name)) {
+            struct tstamp *t = spec->data;
+            t->format = formats[i].format;
+            t->sec = -1;
+            return CFLAG_OK;
+        }
+    }
+    return CFLAG_BAD_FORMAT;
+}
@@ -0,0 +1,63 @@
+/*
+ * tstamp.h
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef __tstamp_h__
+#define __tstamp_h__
+
+#include "deps/cflag/cflag.h"
+#include <stddef.h>
+#include <time.h>
+
+#ifndef TSTAMP_MAXLEN
+#define TSTAMP_MAXLEN 40
+#endif /* !TSTAMP_MAXLEN */
+
+typedef enum {
+    TSTAMP_DEFAULT = 0, /* YYYY-mm-dd/HH:MM:SS             */
+    TSTAMP_TAI64N,      /* @4000000068f44b6f0a3c8b40       */
+    TSTAMP_RFC3339_US,  /* YYYY-mm-ddTHH:MM:SS.uuuuuuZ     */
+    TSTAMP_RFC3339_NS,  /* YYYY-mm-ddTHH:MM:SS.nnnnnnnnnZ  */
+    TSTAMP_EPOCH_NS,    /* Nanoseconds since the epoch     */
+} tstamp_format_t;
+
+/*
+ * Timestamp prefix for log lines, followed by a space. The part of the
+ * text which depends only on the second is kept between updates, and
+ * only rendered again when the second changes; sub-second digits, if
+ * the format has them, are written after it on each update.
+ */
+struct tstamp {
+    tstamp_format_t format;
+    time_t          sec;
+    size_t          frac;
+    size_t          len;
+    char            buf[TSTAMP_MAXLEN];
+};
+
+#define TSTAMP_INIT { .format = TSTAMP_DEFAULT, .sec = -1, .frac = 0, .len = 0 }
+
+/*
+ * Reads the clock used for timestamps. A cheap but coarse clock is used
+ * for formats with second resolution.
+ */
+void tstamp_clock (const struct tstamp *t, struct timespec *now);
+
+/* Updates the text of the timestamp for the given time, returns its length. */
+size_t tstamp_update (struct tstamp *t, const struct timespec *now);
+
+/*
+ * Parses a timestamp in any of the formats above at the start of "text",
+ * which must be followed by a space or the end of the text; the "Z" and
+ * the sub-second digits of RFC 3339 timestamps are optional. Returns the
+ * length of the timestamp, or zero if there is none.
+ */
+size_t tstamp_parse (const char *text, size_t len, struct timespec *ts);
+
+/* Option parser for cflag, "data" must point to a "struct tstamp". */
+enum cflag_status tstamp_format_option (const struct cflag *spec, const char *arg);
+
+#endif /* !__tstamp_h__ */
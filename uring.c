@@ -0,0 +1,293 @@
+/*
+ * uring.c
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include <errno.h>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define HAVE_IO_URING 1
+# endif
+#endif
+
+#ifndef HAVE_IO_URING
+#define HAVE_IO_URING 0
+#endif
+
+#if HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct uring {
+    int                  fd;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned             sq_entries;
+    unsigned             queued;
+    void                *sq_ptr;
+    void                *cq_ptr;
+    size_t               sq_len;
+    size_t               cq_len;
+    size_t               sqes_len;
+};
+
+
+/* Checks that the kernel supports all the operations used. */
+static bool
+uring_supported (int fd)
+{
+    static const uint8_t ops[] = { IORING_OP_WRITE, IORING_OP_FSYNC };
+    const size_t size = sizeof (struct io_uring_probe)
+        + IORING_OP_LAST * sizeof (struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc (1, size);
+    bool supported = false;
+
+    if (probe && syscall (SYS_io_uring_register, fd, IORING_REGISTER_PROBE,
+                          probe, IORING_OP_LAST) == 0) {
+        supported = true;
+        for (size_t i = 0; i < sizeof (ops) / sizeof (ops[0]); i++) {
+            if (ops[i] > probe->last_op ||
+                !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                supported = false;
+        }
+        if (!supported)
+            errno = EOPNOTSUPP;
+    }
+    free (probe);
+    return supported;
+}
+
+
+struct uring*
+uring_new (unsigned entries)
+{
+    struct io_uring_params p;
+    memset (&p, 0, sizeof (p));
+
+    struct uring *ring = calloc (1, sizeof (struct uring));
+    if (!ring)
+        return NULL;
+
+    if ((ring->fd = syscall (SYS_io_uring_setup, entries, &p)) < 0) {
+        free (ring);
+        return NULL;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+
+    /* Older kernels need the two rings mapped separately. */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = 0;
+    }
+
+    ring->sq_ptr = mmap (NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (ring->cq_len) {
+        ring->cq_ptr = mmap (NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto fail;
+    } else {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+
+    ring->sqes = mmap (NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    ring->sq_entries = p.sq_entries;
+
+    if (!uring_supported (ring->fd))
+        goto fail;
+    return ring;
+
+fail:
+    uring_free (ring);
+    return NULL;
+}
+
+
+void
+uring_free (struct uring *ring)
+{
+    if (!ring)
+        return;
+
+    const int saved_errno = errno;
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap (ring->sqes, ring->sqes_len);
+    if (ring->cq_len && ring->cq_ptr && ring->cq_ptr != MAP_FAILED)
+        munmap (ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+        munmap (ring->sq_ptr, ring->sq_len);
+    close (ring->fd);
+    free (ring);
+    errno = saved_errno;
+}
+
+
+int
+uring_fd (const struct uring *ring)
+{
+    return ring->fd;
+}
+
+
+static struct io_uring_sqe*
+uring_sqe (struct uring *ring, uint8_t opcode, int fd, uint64_t data)
+{
+    const unsigned head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+    const unsigned tail = *ring->sq_tail + ring->queued;
+
+    if (tail - head >= ring->sq_entries)
+        return NULL;
+
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset (sqe, 0, sizeof (*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+
+bool
+uring_write (struct uring *ring, int fd, const void *buf, size_t len,
+             off_t offset, uint64_t data, bool link, bool drain)
+{
+    struct io_uring_sqe *sqe = uring_sqe (ring, IORING_OP_WRITE, fd, data);
+    if (!sqe)
+        return false;
+
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->flags = (link ? IOSQE_IO_LINK : 0) | (drain ? IOSQE_IO_DRAIN : 0);
+    return true;
+}
+
+
+bool
+uring_fdatasync (struct uring *ring, int fd, uint64_t data, bool drain)
+{
+    struct io_uring_sqe *sqe = uring_sqe (ring, IORING_OP_FSYNC, fd, data);
+    if (!sqe)
+        return false;
+
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->flags = drain ? IOSQE_IO_DRAIN : 0;
+    return true;
+}
+
+
+int
+uring_submit (struct uring *ring)
+{
+    if (ring->queued) {
+        __atomic_store_n (ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+        ring->queued = 0;
+    }
+
+    /* Includes entries left over by a previous failed call. */
+    const unsigned count = *ring->sq_tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+    if (!count)
+        return 0;
+
+    int r;
+    do {
+        r = syscall (SYS_io_uring_enter, ring->fd, count, 0, 0, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+
+bool
+uring_reap (struct uring *ring, uint64_t *data, int *res)
+{
+    const unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n (ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else /* !HAVE_IO_URING */
+
+struct uring*
+uring_new (unsigned entries)
+{
+    (void) entries;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_free (struct uring *ring) { (void) ring; }
+int  uring_fd (const struct uring *ring) { (void) ring; return -1; }
+int  uring_submit (struct uring *ring) { (void) ring; return -1; }
+
+bool
+uring_write (struct uring *ring, int fd, const void *buf, size_t len,
+             off_t offset, uint64_t data, bool link, bool drain)
+{
+    (void) ring; (void) fd; (void) buf; (void) len;
+    (void) offset; (void) data; (void) link; (void) drain;
+    return false;
+}
+
+bool
+uring_fdatasync (struct uring *ring, int fd, uint64_t data, bool drain)
+{
+    (void) ring; (void) fd; (void) data; (void) drain;
+    return false;
+}
+
+bool
+uring_reap (struct uring *ring, uint64_t *data, int *res)
+{
+    (void) ring; (void) data; (void) res;
+    return false;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,44 @@
+/*
+ * uring.h
+ * Copyright (C) 2026 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef __uring_h__
+#define __uring_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Minimal io_uring wrapper, using the system calls directly to avoid
+ * depending on liburing. Only the operations needed to append to log
+ * files are supported. When io_uring is not available at build time,
+ * uring_new() always fails with ENOSYS.
+ */
+struct uring;
+
+struct uring* uring_new (unsigned entries);
+void uring_free (struct uring *ring);
+int  uring_fd (const struct uring *ring);
+
+/*
+ * Queue operations, which return false if the submission queue is full.
+ * With "link", the next queued operation only runs if this one completes
+ * fully; with "drain", the operation starts only after all the previous
+ * ones have completed.
+ */
+bool uring_write (struct uring *ring, int fd, const void *buf, size_t len,
+                  off_t offset, uint64_t data, bool link, bool drain);
+bool uring_fdatasync (struct uring *ring, int fd, uint64_t data, bool drain);
+
+/* Submits queued operations, returns the number submitted or -1. */
+int  uring_submit (struct uring *ring);
+
+/* Pops a completion without waiting, returns false if there are none. */
+bool uring_reap (struct uring *ring, uint64_t *data, int *res);
+
+#endif /* !__uring_h__ */
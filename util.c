@@ -38,6 +38,21 @@ fd_cloexec (int fd)
         die ("unable to set FD_CLOEXEC\n");
 }
 
+void
+fd_inherit (int fd)
+{
+    if (fcntl (fd, F_SETFD, 0) < 0)
+        die ("unable to clear FD_CLOEXEC\n");
+}
+
+void
+fd_nonblock (int fd)
+{
+    int flags = fcntl (fd, F_GETFL);
+    if (flags < 0 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        die ("unable to set O_NONBLOCK\n");
+}
+
 int
 safe_fsync(int fd)
 {
@@ -48,6 +63,25 @@ safe_fsync(int fd)
     return ret;
 }
 
+int
+safe_fdatasync(int fd)
+{
+    int ret;
+    do {
+        ret = fdatasync(fd);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+unsigned long long
+msec_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000ULL
+        + now.tv_nsec / 1000000 - start->tv_nsec / 1000000;
+}
+
 int
 safe_close(int fd)
 {
@@ -108,6 +142,50 @@ safe_writev(int fd, const struct iovec *iov, int iovcnt)
     return ret;
 }
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif /* !IOV_MAX */
+
+/*
+ * Writes all the data from an iovec array, handling partial writes and
+ * arrays with more than IOV_MAX elements. Elements are updated as data
+ * is written, so the call may be repeated after an error to write the
+ * remaining data. Returns the amount of bytes written, which is less than
+ * the total if an error happens midway, or -1 if nothing was written.
+ */
+ssize_t
+writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+
+        ssize_t r = safe_writev(fd, iov, (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt);
+        if (r < 0)
+            return total ? total : -1;
+
+        total += r;
+        while (r > 0) {
+            if ((size_t) r >= iov->iov_len) {
+                r -= iov->iov_len;
+                iov->iov_len = 0;
+                iov++;
+                iovcnt--;
+            } else {
+                iov->iov_base = (char*) iov->iov_base + r;
+                iov->iov_len -= r;
+                r = 0;
+            }
+        }
+    }
+    return total;
+}
+
 void
 safe_sleep (unsigned seconds)
 {
@@ -636,12 +714,93 @@ replace_args_shift(unsigned amount,
     *pargc = argc;
 }
 
+/*
+ * Finds the end of the chunk of data at the start of "data", which is either
+ * up to and including the delimiter, or "maxlen" bytes when the delimiter
+ * does not appear before that (and "maxlen" is non-zero). Returns zero when
+ * there is no complete chunk yet, and sets "split" for chunks that need a
+ * continuation mark. The first "*scanned" bytes are known not to contain
+ * the delimiter, and it is updated to avoid scanning data more than once.
+ */
+static size_t
+chunk_length(const uint8_t *data,
+             size_t         size,
+             size_t        *scanned,
+             int            delimiter,
+             size_t         maxlen,
+             bool          *split)
+{
+    const size_t scan = (maxlen && size > maxlen) ? maxlen + 1 : size;
+    const uint8_t *pos = (*scanned < scan)
+        ? memchr(data + *scanned, delimiter, scan - *scanned)
+        : NULL;
+    *scanned = scan;
+
+    *split = false;
+    if (pos)
+        return pos - data + 1;
+
+    if (maxlen && size > maxlen) {
+        *split = true;
+        return maxlen;
+    }
+    return 0;
+}
+
+void
+buffer_reserve(struct dbuf *buffer, size_t size)
+{
+    assert(buffer);
+
+    const size_t oldlen = dbuf_size(buffer);
+    if (buffer->alloc > oldlen + size)
+        return;
+
+    /*
+     * XXX Calling dbuf_resize() will *both* resize the buffer data
+     * area and set buffer->alloc *and* buffer->size. But we do not
+     * want the later to be changed we save and restore it.
+     */
+    size_t alloc = buffer->alloc ? buffer->alloc * 2 : size;
+    if (alloc < oldlen + size)
+        alloc = oldlen + size;
+    dbuf_resize(buffer, alloc);
+    buffer->size = oldlen;
+}
+
+static void
+move_chunk(struct dbuf   *buffer,
+           const uint8_t *data,
+           size_t         len,
+           bool           split,
+           int            delimiter,
+           const char    *mark)
+{
+    dbuf_addmem(buffer, data, len);
+    if (split) {
+        if (mark)
+            dbuf_addstr(buffer, mark);
+        dbuf_addch(buffer, delimiter);
+    }
+}
+
+static void
+consume(struct dbuf *overflow, size_t len)
+{
+    overflow->size -= len;
+    memmove(dbuf_data(overflow),
+            dbuf_data(overflow) + len,
+            dbuf_size(overflow));
+}
+
 ssize_t
 freaduntil(int          fd,
            struct dbuf *buffer,
            struct dbuf *overflow,
            int          delimiter,
-           size_t       readbytes)
+           size_t       readbytes,
+           size_t       maxlen,
+           const char  *mark)
 {
     assert(fd >= 0);
     assert(buffer);
@@ -652,35 +811,25 @@ freaduntil(int          fd,
         readbytes = default_readbytes;
     }
 
+    size_t scanned = 0;
     for (;;) {
-        char *pos = memchr(dbuf_cdata (overflow),
-                           delimiter,
-                           dbuf_size (overflow));
+        bool split;
+        size_t len = chunk_length(dbuf_cdata(overflow),
+                                  dbuf_size(overflow),
+                                  &scanned, delimiter, maxlen, &split);
 
-        if (pos) {
+        if (len) {
             /*
-             * The delimiter has been found in the overflow buffer: remove
-             * it from there, and copy the data to the result buffer.
+             * The delimiter has been found in the overflow buffer (or the
+             * chunk is too long already): remove it from there, and copy
+             * the data to the result buffer.
              */
-            size_t len = pos - (const char*) dbuf_cdata (overflow) + 1;
-            dbuf_addmem(buffer, dbuf_cdata (overflow), len);
-            overflow->size -= len;
-            memmove (dbuf_data(overflow),
-                     dbuf_data(overflow) + len,
-                     dbuf_size(overflow));
+            move_chunk(buffer, dbuf_cdata(overflow), len, split, delimiter, mark);
+            consume(overflow, len);
             return dbuf_size(buffer);
         }
 
-        if (overflow->alloc < (dbuf_size(overflow) + readbytes)) {
-            /*
-             * XXX Calling dbuf_resize() will *both* resize the buffer data
-             * area and set overflow->alloc *and* overflow->size. But we
-             * do not want the later to be changed we save and restore it.
-             */
-            const size_t oldlen = dbuf_size(overflow);
-            dbuf_resize(overflow, oldlen + readbytes);
-            overflow->size = oldlen;
-        }
+        buffer_reserve(overflow, readbytes);
 
         ssize_t r = safe_read(fd, dbuf_data(overflow) + dbuf_size(overflow), readbytes);
         if (r > 0) {
@@ -692,6 +841,56 @@ freaduntil(int          fd,
     }
 }
 
+/*
+ * Moves all the complete chunks of data ending in the delimiter which are
+ * available in the overflow buffer into the result buffer at once. Returns
+ * the amount of bytes moved.
+ */
+size_t
+drainuntil(struct dbuf *buffer,
+           struct dbuf *overflow,
+           int          delimiter,
+           size_t       maxlen,
+           const char  *mark)
+{
+    assert(buffer);
+    assert(overflow);
+
+    if (dbuf_empty(overflow))
+        return 0;
+
+    if (!maxlen) {
+        const uint8_t *pos = memrchr(dbuf_cdata(overflow),
+                                     delimiter,
+                                     dbuf_size(overflow));
+        if (!pos)
+            return 0;
+
+        size_t len = pos - dbuf_cdata(overflow) + 1;
+        dbuf_addmem(buffer, dbuf_cdata(overflow), len);
+        consume(overflow, len);
+        return len;
+    }
+
+    /* Each chunk needs to be checked against the maximum length. */
+    const uint8_t *data = dbuf_cdata(overflow);
+    const size_t size = dbuf_size(overflow);
+    size_t pos = 0;
+
+    for (;;) {
+        size_t scanned = 0;
+        bool split;
+        size_t len = chunk_length(data + pos, size - pos, &scanned, delimiter, maxlen, &split);
+        if (!len)
+            break;
+        move_chunk(buffer, data + pos, len, split, delimiter, mark);
+        pos += len;
+    }
+
+    consume(overflow, pos);
+    return pos;
+}
+
 NORETURN static inline void
 doexit(int code)
 {
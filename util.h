@@ -29,6 +29,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <time.h>
 
 #ifdef __GLIBC_PREREQ
 # if __GLIBC_PREREQ(2, 29)
@@ -70,16 +71,24 @@ int name_to_gid (const char*, gid_t*);
 
 int safe_close(int fd);
 int safe_fsync(int fd);
+int safe_fdatasync(int fd);
 NODISCARD int safe_openat(int fd, const char*, int flags);
 NODISCARD int safe_openatm(int fd, const char*, int flags, mode_t);
 NODISCARD ssize_t safe_read(int fd, void*, size_t);
 NODISCARD ssize_t safe_writev(int fd, const struct iovec*, int iovcnt);
+NODISCARD ssize_t writev_all(int fd, struct iovec*, int iovcnt);
 NODISCARD FILE* safe_fdopen(int fd, const char *mode);
+
+/* Milliseconds elapsed since a CLOCK_MONOTONIC time. */
+unsigned long long msec_since(const struct timespec *start);
+
 void safe_sleep (unsigned);
 void safe_sigaction (const char*, int, struct sigaction*);
 void safe_setrlimit (int what, long value);
 
 void fd_cloexec (int);
+void fd_inherit (int);
+void fd_nonblock (int);
 void become_daemon (void);
 int  interruptible_sleep (unsigned);
 const char* limit_name (int);
@@ -99,11 +108,22 @@ void replace_args_shift(unsigned amount,
                         int     *pargc,
                         char  ***pargv);
 
+#ifndef LINE_CONTINUATION
+#define LINE_CONTINUATION "\\"
+#endif /* !LINE_CONTINUATION */
+
+/*
+ * When "maxlen" is non-zero, chunks of data longer than that are split,
+ * and each part except the last is terminated with "mark" (if non-NULL)
+ * and the delimiter; so the amount of data kept in "overflow" is bounded.
+ */
 ssize_t freaduntil(int          fd,
                    struct dbuf *buffer,
                    struct dbuf *overflow,
                    int          delimiter,
-                   size_t       readbytes);
+                   size_t       readbytes,
+                   size_t       maxlen,
+                   const char  *mark);
 
 static inline ssize_t
 freadline(int          fd,
@@ -111,7 +131,54 @@ freadline(int          fd,
           struct dbuf *overflow,
           size_t       readbytes)
 {
-    return freaduntil(fd, buffer, overflow, '\n', readbytes);
+    return freaduntil(fd, buffer, overflow, '\n', readbytes, 0, NULL);
+}
+
+static inline ssize_t
+freadline_max(int          fd,
+              struct dbuf *buffer,
+              struct dbuf *overflow,
+              size_t       maxlen,
+              const char  *mark)
+{
+    return freaduntil(fd, buffer, overflow, '\n', 0, maxlen, mark);
+}
+
+/*
+ * Makes room for at least "size" more bytes after the data in a buffer,
+ * without changing its size. Capacity grows geometrically, so appending
+ * data piece by piece does not reallocate each time.
+ */
+void buffer_reserve(struct dbuf *buffer, size_t size);
+
+static inline void
+buffer_append(struct dbuf *buffer, const void *data, size_t size)
+{
+    buffer_reserve(buffer, size);
+    memcpy(dbuf_data(buffer) + dbuf_size(buffer), data, size);
+    buffer->size += size;
+}
+
+size_t drainuntil(struct dbuf *buffer,
+                  struct dbuf *overflow,
+                  int          delimiter,
+                  size_t       maxlen,
+                  const char  *mark);
+
+static inline size_t
+drainlines(struct dbuf *buffer,
+           struct dbuf *overflow)
+{
+    return drainuntil(buffer, overflow, '\n', 0, NULL);
+}
+
+static inline size_t
+drainlines_max(struct dbuf *buffer,
+               struct dbuf *overflow,
+               size_t       maxlen,
+               const char  *mark)
+{
+    return drainuntil(buffer, overflow, '\n', maxlen, mark);
 }
 
 NORETURN void errexit(int code, const char *format, ...)